@@ -0,0 +1,130 @@
+
+#include <stdexcept>
+
+#include "iblt.h"
+
+using namespace std;
+
+/* Largest table operator>> accepts, to bound memory on bad input */
+constexpr size_t max_cells = 0x1000000;
+
+static inline uint64_t
+mix (uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+static inline uint64_t
+checksum (uint64_t key)
+{
+  return mix (key ^ 0xa0761d6478bd642f);
+}
+
+iblt::iblt(size_t ncells)
+  : cells_((ncells + nhash - 1) / nhash * nhash)
+{
+}
+
+/* Each hash function picks a cell in its own third of the table, so
+ * a key never lands twice in the same cell. */
+size_t
+iblt::index(uint64_t key, int i) const
+{
+  size_t m = cells_.size() / nhash;
+  return i * m + mix (key + uint64_t(i) * 0x632be59bd9b4e019) % m;
+}
+
+void
+iblt::update(uint64_t key, int64_t n)
+{
+  if (cells_.empty())
+    throw logic_error ("iblt: update of empty table");
+  uint64_t sum = checksum (key);
+  for (int i = 0; i < nhash; i++) {
+    cell &c = cells_[index(key, i)];
+    c.count += n;
+    if (n & 1) {
+      c.keysum ^= key;
+      c.checksum ^= sum;
+    }
+  }
+}
+
+iblt &
+iblt::operator-=(const iblt &other)
+{
+  if (other.size() != size())
+    throw invalid_argument ("iblt: subtracting table of different size");
+  for (size_t i = 0; i < cells_.size(); i++) {
+    cells_[i].count -= other.cells_[i].count;
+    cells_[i].keysum ^= other.cells_[i].keysum;
+    cells_[i].checksum ^= other.cells_[i].checksum;
+  }
+  return *this;
+}
+
+bool
+iblt::decode(vector<uint64_t> *plus, vector<uint64_t> *minus) const
+{
+  iblt t (*this);
+  auto pure = [&t](size_t i) {
+    const cell &c = t.cells_[i];
+    return (c.count == 1 || c.count == -1)
+      && c.checksum == checksum (c.keysum);
+  };
+
+  vector<size_t> queue;
+  for (size_t i = 0; i < t.size(); i++)
+    if (pure(i))
+      queue.push_back(i);
+  while (!queue.empty()) {
+    size_t i = queue.back();
+    queue.pop_back();
+    if (!pure(i))
+      continue;
+    uint64_t key = t.cells_[i].keysum;
+    int64_t n = t.cells_[i].count;
+    (n > 0 ? plus : minus)->push_back(key);
+    t.update(key, -n);
+    for (int j = 0; j < nhash; j++) {
+      size_t k = t.index(key, j);
+      if (pure(k))
+	queue.push_back(k);
+    }
+  }
+
+  for (const cell &c : t.cells_)
+    if (c.count || c.keysum || c.checksum)
+      return false;
+  return true;
+}
+
+ostream &
+operator<<(ostream &os, const iblt &t)
+{
+  os << t.size();
+  for (const iblt::cell &c : t.cells_)
+    os << ' ' << c.count << ' ' << hex << c.keysum << ' ' << c.checksum
+       << dec;
+  return os;
+}
+
+istream &
+operator>>(istream &is, iblt &t)
+{
+  size_t n;
+  if (!(is >> n))
+    return is;
+  if (n > max_cells || n % iblt::nhash) {
+    is.setstate (ios_base::failbit);
+    return is;
+  }
+  t.cells_.assign(n, iblt::cell());
+  for (iblt::cell &c : t.cells_)
+    if (!(is >> dec >> c.count >> hex >> c.keysum >> c.checksum >> dec))
+      break;
+  return is;
+}
@@ -0,0 +1,56 @@
+// -*- C++ -*-
+
+#ifndef _IBLT_H_
+#define _IBLT_H_ 1
+
+/** \file iblt.h
+ *  \brief Invertible Bloom lookup tables for set reconciliation.
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+/** \brief An invertible Bloom lookup table over 64-bit keys.
+ *
+ * Two parties each insert their own set into a table of the same
+ * size.  Subtracting one table from the other cancels the keys the
+ * sets have in common, and decode() then lists the symmetric
+ * difference, provided it is not too large for the table (with three
+ * hash functions, somewhat less than one key per 1.5 cells).  Keys
+ * should already be uniformly distributed, e.g., a prefix of a
+ * cryptographic hash.
+ */
+class iblt {
+public:
+  static constexpr int nhash = 3;
+  struct cell {
+    std::int64_t count = 0;
+    std::uint64_t keysum = 0;
+    std::uint64_t checksum = 0;
+  };
+
+private:
+  std::vector<cell> cells_;
+  std::size_t index(std::uint64_t key, int i) const;
+  void update(std::uint64_t key, std::int64_t n);
+
+public:
+  /** The number of cells is rounded up to a multiple of nhash. */
+  explicit iblt(std::size_t ncells = 0);
+  std::size_t size() const { return cells_.size(); }
+  void insert(std::uint64_t key) { update(key, 1); }
+  void erase(std::uint64_t key) { update(key, -1); }
+  /** Subtract a table of the same size. */
+  iblt &operator-=(const iblt &other);
+  /** Append keys with a positive count to plus and keys with a
+   *  negative count to minus.  Returns false if the table could not
+   *  be decoded completely, in which case the lists are partial. */
+  bool decode(std::vector<std::uint64_t> *plus,
+	      std::vector<std::uint64_t> *minus) const;
+
+  friend std::ostream &operator<<(std::ostream &os, const iblt &t);
+  friend std::istream &operator>>(std::istream &is, iblt &t);
+};
+
+#endif /* !_IBLT_H_ */
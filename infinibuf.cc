@@ -160,6 +160,18 @@ infinistreambuf::underflow()
   return eof ? traits_type::eof() : traits_type::to_int_type (*gptr());
 }
 
+streamsize
+infinistreambuf::showmanyc()
+{
+  lock_guard<infinibuf> _lk (*ib_);
+  if (int n = gptr() - ib_->gptr())
+    ib_->gbump(n);
+  setg(ib_->eback(), ib_->gptr(), ib_->egptr());
+  if (ib_->gsize())
+    return ib_->gsize();
+  return ib_->eof() ? -1 : 0;
+}
+
 infinistreambuf::int_type
 infinistreambuf::overflow(int_type ch)
 {
@@ -167,6 +167,7 @@ protected:
   int_type underflow() override;
   int_type overflow(int_type ch) override;
   int sync() override;
+  std::streamsize showmanyc() override;
 public:
   explicit infinistreambuf(std::shared_ptr<infinibuf> ib);
   explicit infinistreambuf(infinibuf *ib)
@@ -8,64 +8,183 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 #include "misc.h"
 
 using namespace std;
 
+/* Character classes for the percent codec */
+namespace {
+struct codec_tables {
+  bool escape[256];		// percent_encode must escape
+  bool permissive_escape[256];	// permissive_percent_encode must escape
+  signed char hexval[256];	// -1 if not a (lower-case) hex digit
+  codec_tables() {
+    for (int i = 0; i < 256; i++) {
+      char c = i;
+      escape[i] = !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')
+		    || (c >= 'A' && c <= 'Z') || (c >= '+' && c <= '.')
+		    || c == '_' || c == '@' || c == '=');
+      permissive_escape[i] = i <= ' ' || i >= '\177'
+	|| c == '%' || c == '(' || c == ')';
+      hexval[i] = c >= '0' && c <= '9' ? c - '0'
+	: c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    }
+  }
+};
+const codec_tables tables;
+const char hexchars[] = "0123456789abcdef";
+}
+
+static inline void
+append_escape (string *out, unsigned char c)
+{
+  char esc[3] = { '%', hexchars[c >> 4], hexchars[c & 0xf] };
+  out->append (esc, 3);
+}
+
+static inline void
+append_escape (ostream &out, unsigned char c)
+{
+  char esc[3] = { '%', hexchars[c >> 4], hexchars[c & 0xf] };
+  out.write (esc, 3);
+}
+
+static inline void
+append_run (string *out, const char *p, size_t n)
+{
+  out->append (p, n);
+}
+
+static inline void
+append_run (ostream &out, const char *p, size_t n)
+{
+  out.write (p, n);
+}
+
+void
+percent_encode (const char *p, size_t n, string *out)
+{
+  const char *e = p + n;
+  while (p < e) {
+    const char *q = p;
+    while (q < e && !tables.escape[uint8_t (*q)])
+      q++;
+    out->append (p, q);
+    if (q < e)
+      append_escape (out, *q++);
+    p = q;
+  }
+}
+
 string
 percent_encode (const string &raw)
 {
-  ostringstream outbuf;
-  outbuf.fill('0');
-  outbuf.setf(ios::hex, ios::basefield);
+  string ret;
+  ret.reserve (raw.size());
+  percent_encode (raw.data(), raw.size(), &ret);
+  return ret;
+}
 
-  for (char c : raw) {
-    if (isalnum (c) || (c >= '+' && c <= '.')
-	|| c == '_' || c == '@' || c == '=')
-      outbuf << c;
-    else
-      outbuf << '%' << setw(2) << int (uint8_t (c));
+size_t
+permissive_percent_span (const char *p, size_t n)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  /* Bytes <= ' ' or >= 0x80 are exactly those < '!' as signed chars */
+  const __m128i bang = _mm_set1_epi8 ('!'), del = _mm_set1_epi8 ('\177'),
+    pct = _mm_set1_epi8 ('%'), lp = _mm_set1_epi8 ('('),
+    rp = _mm_set1_epi8 (')');
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (p + i));
+    __m128i bad = _mm_or_si128
+      (_mm_or_si128 (_mm_cmplt_epi8 (v, bang), _mm_cmpeq_epi8 (v, del)),
+       _mm_or_si128 (_mm_cmpeq_epi8 (v, pct),
+		     _mm_or_si128 (_mm_cmpeq_epi8 (v, lp),
+				   _mm_cmpeq_epi8 (v, rp))));
+    if (int mask = _mm_movemask_epi8 (bad))
+      return i + __builtin_ctz (mask);
   }
-  return outbuf.str ();
+#endif /* __SSE2__ */
+  while (i < n && !tables.permissive_escape[uint8_t (p[i])])
+    i++;
+  return i;
+}
+
+template<typename Out> static void
+permissive_encode_to (const char *p, size_t n, Out &&out)
+{
+  const char *e = p + n;
+  while (p < e) {
+    size_t clean = permissive_percent_span (p, e - p);
+    append_run (out, p, clean);
+    p += clean;
+    if (p < e)
+      append_escape (out, *p++);
+  }
+}
+
+void
+permissive_percent_encode (const char *p, size_t n, string *out)
+{
+  permissive_encode_to (p, n, out);
+}
+
+void
+permissive_percent_encode (const char *p, size_t n, ostream &out)
+{
+  permissive_encode_to (p, n, out);
+}
+
+string
+permissive_percent_encode (const string &raw)
+{
+  string ret;
+  ret.reserve (raw.size());
+  permissive_percent_encode (raw.data(), raw.size(), &ret);
+  return ret;
 }
 
 inline int
 hexdigit (char c)
 {
-  if (c >= '0' && c <= '9')
-    return c - '0';
-  else if (c >= 'a' && c <= 'f')
-    return c - 'a' + 10;
-  else
+  int v = tables.hexval[uint8_t (c)];
+  if (v < 0)
     throw runtime_error ("precent_decode: illegal hexdigit " + string (1, c));
+  return v;
 }
 
-string
-percent_decode (const string &encoded)
+void
+percent_decode (const char *p, size_t n, string *out)
 {
-  ostringstream outbuf;
-  int escape_pos = 0, escape_val = 0;
-  for (char c : encoded) {
-    switch (escape_pos) {
-    case 0:
-      if (c == '%')
-	escape_pos = 1;
-      else
-	outbuf << c;
-      break;
-    case 1:
-      escape_val = hexdigit(c) << 4;
-      escape_pos = 2;
-      break;
-    case 2:
-      escape_pos = 0;
-      outbuf << char (escape_val | hexdigit(c));
+  out->clear();
+  const char *e = p + n;
+  while (p < e) {
+    const char *q = static_cast<const char *> (memchr (p, '%', e - p));
+    if (!q) {
+      out->append (p, e);
       break;
     }
+    out->append (p, q);
+    if (e - q < 3) {
+      // Diagnose a bad digit before a missing one, as always
+      if (e - q == 2)
+	hexdigit (q[1]);
+      throw runtime_error ("percent_decode: incomplete escape");
+    }
+    *out += char (hexdigit (q[1]) << 4 | hexdigit (q[2]));
+    p = q + 3;
   }
-  if (escape_pos)
-    throw runtime_error ("percent_decode: incomplete escape");
-  return outbuf.str();
+}
+
+string
+percent_decode (const string &encoded)
+{
+  string ret;
+  percent_decode (encoded.data(), encoded.size(), &ret);
+  return ret;
 }
 
 std::istream &
@@ -105,6 +224,23 @@ hexdump (const string &s)
   return ret;
 }
 
+string
+hash_to_key (const string &hash)
+{
+  if (!hash_ok (hash))
+    return {};
+  string key (hash_ctx::output_bytes, '\0');
+  for (size_t i = 0; i < key.size(); i++)
+    key[i] = hexdigit (hash[2*i]) << 4 | hexdigit (hash[2*i+1]);
+  return key;
+}
+
+string
+hash_from_key (const string &key)
+{
+  return hexdump (key);
+}
+
 string
 hash_ctx::final()
 {
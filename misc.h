@@ -4,6 +4,7 @@
 #define _MUCHSYNC_MISC_H_ 1
 
 #include <cstddef>
+#include <iosfwd>
 #include <string>
 #include <time.h>
 #include <sys/time.h>
@@ -26,7 +27,20 @@ find_default (typename C::mapped_type def, const C &c, typename C::key_type k)
 
 std::istream &input_match (std::istream &in, char want);
 string percent_encode (const string &raw);
+/** Append the encoding of n bytes at p to *out. */
+void percent_encode (const char *p, size_t n, string *out);
+/** Like percent_encode, but only escapes what would break the
+ *  space-separated, parenthesized fields of protocol records. */
+string permissive_percent_encode (const string &raw);
+void permissive_percent_encode (const char *p, size_t n, string *out);
+/** Write the encoding to out, without building it in a string. */
+void permissive_percent_encode (const char *p, size_t n, std::ostream &out);
+/** The number of leading bytes of p that permissive_percent_encode
+ *  leaves as they are. */
+size_t permissive_percent_span (const char *p, size_t n);
 string percent_decode (const string &escaped);
+/** Decode n bytes at p into *out, reusing its storage. */
+void percent_decode (const char *p, size_t n, string *out);
 
 class hash_ctx {
   SHA_CTX ctx_;
@@ -38,6 +52,10 @@ public:
   string final();
 };
 bool hash_ok (const string &hash);
+/** Hashes are stored in state.db as hash_ctx::output_bytes raw bytes.
+ *  hash_to_key returns an empty string if !hash_ok(hash). */
+string hash_to_key (const string &hash);
+string hash_from_key (const string &key);
 
 constexpr double
 ts_to_double (const timespec &ts)
@@ -1,13 +1,20 @@
 
 #include <cstring>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <vector>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include "misc.h"
 #include "muchsync.h"
@@ -30,17 +37,24 @@ const char muchsync_defdir[] = MUCHSYNC_DEFDIR;
 const char muchsync_dbpath[] = MUCHSYNC_DEFDIR "/state.db";
 const char muchsync_trashdir[] = MUCHSYNC_DEFDIR "/trash";
 const char muchsync_tmpdir[] = MUCHSYNC_DEFDIR "/tmp";
+const char muchsync_sockpath[] = MUCHSYNC_DEFDIR "/socket";
 
 constexpr char shell[] = "/bin/sh";
+constexpr int daemon_scan_interval = 60;	// Seconds between notmuch new
+constexpr int daemon_watch_interval = 250;	// Milliseconds between scans
 
 bool opt_fullscan;
 bool opt_noscan;
 bool opt_init;
 bool opt_server;
+bool opt_daemon;
 bool opt_upbg;
 bool opt_noup;
+bool opt_overlap;
+bool opt_continuous;
 bool opt_nonew;
 int opt_verbose;
+int opt_channels = 1;
 int opt_upbg_fd = -1;
 string opt_ssh = "ssh -CTaxq";
 string opt_remote_muchsync_path = "muchsync";
@@ -112,6 +126,7 @@ usage (int code = 1)
 usage: muchsync\n\
        muchsync server [server-options]\n\
        muchsync --init maildir server [server-options]\n\
+       muchsync --daemon\n\
 \n\
 Additional options:\n\
    -C file       Specify path to notmuch config file\n\
@@ -123,6 +138,10 @@ Additional options:\n\
    --nonew       Do not run notmuch new first\n\
    --noup[load]  Do not upload changes to server\n\
    --upbg        Download mail in forground, then upload in background\n\
+   --overlap     Upload changes while downloading instead of afterwards\n\
+   --channels n  Download message content over n connections\n\
+   --daemon      Keep serving clients that connect through --server\n\
+   --continuous  Keep synchronizing changes as they happen\n\
    --self        Print local replica identifier and exit\n\
    --version     Print version number and exit\n\
    --help        Print usage\n";
@@ -143,24 +162,102 @@ print_self()
   sqlite3 *db = dbopen(dbpath.c_str(), false);
   if (!db)
     exit(1);
-  cleanup _c (sqlite3_close_v2, db);
+  cleanup _c (sqlclose, db);
   cout << getconfig<i64>(db, "self") << '\n';
 }
 
+/* Returns a unix-domain socket connected to the daemon for maildir,
+ * or if listening is true, a socket on which the daemon can accept
+ * connections.  Returns -1 with errno set on failure. */
+static int
+daemon_socket (const string &maildir, bool listening)
+{
+  string path = maildir + muchsync_sockpath;
+  sockaddr_un sun;
+  if (path.size() >= sizeof (sun.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path.c_str());
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  fcntl (fd, F_SETFD, 1);
+  int err = listening
+    ? bind (fd, reinterpret_cast<sockaddr *> (&sun), sizeof (sun))
+    : connect (fd, reinterpret_cast<sockaddr *> (&sun), sizeof (sun));
+  if (!err && listening)
+    err = listen (fd, 16);
+  if (err) {
+    int saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
 static void
-server()
+copy_fd (int from, int to)
 {
-  ifdinfinistream ibin(0);
-  cleanup _fixbuf ([](streambuf *sb){ cin.rdbuf(sb); },
-		   cin.rdbuf(ibin.rdbuf()));
-  tag_stderr("[SERVER] ");
+  char buf[16384];
+  ssize_t n;
+  while ((n = read (from, buf, sizeof (buf))) > 0)
+    for (ssize_t i = 0, w; i < n; i += w)
+      if ((w = write (to, buf + i, n - i)) <= 0)
+	return;
+}
 
+/* If a daemon is running for maildir, shuttle bytes between it and
+ * stdin/stdout until it hangs up, and return true. */
+static bool
+relay_to_daemon (const string &maildir)
+{
+  int fd = daemon_socket (maildir, false);
+  if (fd < 0)
+    return false;
+  thread t ([fd]() {
+      copy_fd (0, fd);
+      shutdown (fd, SHUT_WR);
+    });
+  t.detach();
+  copy_fd (fd, 1);
+  return true;
+}
+
+static void
+server()
+{
   unique_ptr<notmuch_db> nmp;
   try {
     nmp.reset(new notmuch_db (opt_notmuch_config));
   } catch (whattocatch_t e) { cerr << e.what() << '\n'; exit (1); }
   notmuch_db &nm = *nmp;
 
+  // A daemon's scan is at least as fresh as one we would do now.
+  if (!opt_noscan && relay_to_daemon (nm.maildir))
+    exit (0);
+  // Extra connections (--noscan) would have to wait for the daemon
+  // session of their own sync to let go of the databases, so they
+  // cannot go through the daemon, and must not use the databases
+  // behind its back either.
+  if (opt_noscan) {
+    int fd = daemon_socket (nm.maildir, false);
+    if (fd >= 0) {
+      close (fd);
+      cerr << "muchsync daemon running; cannot serve --channels\n";
+      exit (1);
+    }
+  }
+
+  ifdinfinistream ibin(0);
+  cleanup _fixbuf ([](streambuf *sb){ cin.rdbuf(sb); },
+		   cin.rdbuf(ibin.rdbuf()));
+  tag_stderr("[SERVER] ");
+
   string dbpath = nm.maildir + muchsync_dbpath;
 
   if (!opt_nonew)
@@ -171,12 +268,13 @@ server()
   sqlite3 *db = dbopen(dbpath.c_str());
   if (!db)
     exit(1);
-  cleanup _c (sqlite3_close_v2, db);
+  cleanup _c (sqlclose, db);
 
   try {
+    server_state st (db, nm);
     if (!opt_noscan)
-      sync_local_data(db, nm.maildir);
-    muchsync_server(db, nm);
+      st.scan(true);
+    muchsync_server(st, cin, cout);
   }
   catch (whattocatch_t &e) {
     cerr << e.what() << '\n';
@@ -184,6 +282,104 @@ server()
   }
 }
 
+static void
+serve_client (server_state &st, int fd)
+{
+  int ofd = dup (fd);
+  if (ofd < 0) {
+    cerr << "dup: " << strerror (errno) << '\n';
+    close (fd);
+    return;
+  }
+  fcntl (ofd, F_SETFD, 1);
+  ifdinfinistream in (fd);
+  ofdstream out (ofd);
+  in.tie (&out);
+  try {
+    muchsync_server (st, in, out);
+    out.flush();
+  }
+  catch (whattocatch_t &e) {
+    cerr << e.what() << '\n';
+  }
+}
+
+/* Run as a long-lived server.  Clients reach the daemon through
+ * "muchsync --server", which relays to the daemon's socket instead
+ * of starting from scratch.  Each client gets a thread of its own,
+ * and answers from the daemon's last scan, while the main thread
+ * accepts connections and keeps that scan current:  it looks at
+ * Xapian as often as a --continuous client would, and runs notmuch
+ * new every daemon_scan_interval.  The sessions and the scans take
+ * turns with the databases (see server_state), since only one
+ * process can write to the notmuch database, and the databases stay
+ * open from one session to the next. */
+static void
+run_daemon()
+{
+  unique_ptr<notmuch_db> nmp;
+  try {
+    nmp.reset(new notmuch_db (opt_notmuch_config));
+  } catch (whattocatch_t e) { cerr << e.what() << '\n'; exit (1); }
+  notmuch_db &nm = *nmp;
+
+  if (!muchsync_init (nm.maildir))
+    exit (1);
+  string sockpath = nm.maildir + muchsync_sockpath;
+  int lfd = daemon_socket (nm.maildir, true);
+  if (lfd < 0 && errno == EADDRINUSE) {
+    int fd = daemon_socket (nm.maildir, false);
+    if (fd >= 0) {
+      cerr << sockpath << ": daemon already running\n";
+      exit (1);
+    }
+    unlink (sockpath.c_str());	// Left over from a dead daemon
+    lfd = daemon_socket (nm.maildir, true);
+  }
+  if (lfd < 0) {
+    cerr << sockpath << ": " << strerror (errno) << '\n';
+    exit (1);
+  }
+  cleanup _unlink (unlink, sockpath.c_str());
+  fcntl (lfd, F_SETFL, O_NONBLOCK);
+  signal (SIGPIPE, SIG_IGN);
+
+  string dbpath = nm.maildir + muchsync_dbpath;
+  sqlite3 *db = dbopen(dbpath.c_str());
+  if (!db)
+    exit(1);
+  cleanup _c (sqlclose, db);
+  server_state st (db, nm);
+  st.rescanning = true;
+
+  time_t last_new = 0;
+  for (;;) {
+    // A session in the middle of a sync just puts the scan off
+    if (unique_lock<mutex> lk {st.lock, try_to_lock}) {
+      try {
+	if (time (nullptr) - last_new >= daemon_scan_interval) {
+	  if (!opt_nonew) {
+	    nm.close();
+	    nm.run_new();
+	  }
+	  last_new = time (nullptr);
+	  st.scan(true);
+	}
+	else
+	  st.scan();
+      }
+      catch (whattocatch_t &e) {
+	cerr << e.what() << '\n';
+      }
+    }
+    pollfd pfd { lfd, POLLIN, 0 };
+    poll (&pfd, 1, daemon_watch_interval);
+    for (int fd; (fd = accept (lfd, nullptr, nullptr)) >= 0;) {
+      fcntl (fd, F_SETFD, 1);
+      thread (serve_client, ref (st), fd).detach();
+    }
+  }
+}
 
 static void
 cmd_iofds (int fds[2], const string &cmd)
@@ -232,14 +428,22 @@ cmd_iofds (int fds[2], const string &cmd)
   }
 }
 
+static string channel_cmd;
+
+void
+open_channel (int fds[2])
+{
+  cmd_iofds (fds, channel_cmd);
+}
+
 static void
-create_config(istream &in, ostream &out, string &maildir)
+create_config(istream &in, ostream &out, string &maildir, string &greeting)
 {
   if (!maildir.size() || !maildir.front())
     throw runtime_error ("illegal empty maildir path\n");
   string line;
   out << "conffile\n";
-  get_response(in, line);
+  get_response(in, greeting);
   get_response(in, line);
   size_t len = stoul(line.substr(4));
   if (len <= 0)
@@ -248,6 +452,7 @@ create_config(istream &in, ostream &out, string &maildir)
   conf.resize(len);
   if (!in.read(&conf.front(), len))
     throw runtime_error ("cannot read configuration file from server\n");
+  get_response(in, line);
 
   int fd = open(opt_notmuch_config.c_str(), O_CREAT|O_TRUNC|O_WRONLY|O_EXCL,
 		0666);
@@ -304,7 +509,7 @@ client(int ac, char **av)
     sqlite3 *db = dbopen(dbpath.c_str());
     if (!db)
       exit (1);
-    cleanup _c (sqlite3_close_v2, db);
+    cleanup _c (sqlclose, db);
     sync_local_data (db, nmp->maildir);
     exit(0);
   }
@@ -315,30 +520,52 @@ client(int ac, char **av)
   for (int i = 1; i < ac; i++)
     os << ' ' << av[i];
   string cmd (os.str());
+  os.str("");
+  os << opt_ssh << ' ' << av[0] << ' ' << opt_remote_muchsync_path
+     << " --server --nonew --noscan";
+  for (int i = 1; i < ac; i++)
+    os << ' ' << av[i];
+  channel_cmd = os.str();
   int fds[2];
   cmd_iofds (fds, cmd);
   ofdstream out (fds[1]);
   ifdinfinistream in (fds[0]);
   in.tie (&out);
 
+  string greeting;
   if (opt_init) {
-    create_config(in, out, opt_init_dest);
+    create_config(in, out, opt_init_dest, greeting);
     try {
       nmp.reset(new notmuch_db (opt_notmuch_config, true));
     } catch (whattocatch_t e) { cerr << e.what() << '\n'; exit (1); }
   }
   if (!muchsync_init(nmp->maildir, true))
     exit(1);
-  if (!opt_nonew)
+  /* A new replica receives all of the server's files up front, so
+   * notmuch new can index them in one pass. */
+  replica_image img;
+  bool image = false;
+  if (opt_init) {
+    try {
+      image = fetch_image (in, out, greeting, nmp->maildir, img);
+    }
+    catch (whattocatch_t &e) {
+      cerr << e.what() << '\n';
+      exit (1);
+    }
+  }
+  if (!opt_nonew || image)
     nmp->run_new();
   string dbpath = nmp->maildir + muchsync_dbpath;
   sqlite3 *db = dbopen(dbpath.c_str(), true);
   if (!db)
     exit (1);
-  cleanup _c (sqlite3_close_v2, db);
+  cleanup _c (sqlclose, db);
 
   try {
-    muchsync_client (db, *nmp, in, out);
+    if (image)
+      apply_image (db, *nmp, img);
+    muchsync_client (db, *nmp, in, out, greeting);
   }
   catch (whattocatch_t &e) {
     cerr << e.what() << '\n';
@@ -349,9 +576,13 @@ client(int ac, char **av)
 enum opttag {
   OPT_VERSION = 0x100,
   OPT_SERVER,
+  OPT_DAEMON,
   OPT_NOSCAN,
   OPT_UPBG,
   OPT_NOUP,
+  OPT_OVERLAP,
+  OPT_CHANNELS,
+  OPT_CONTINUOUS,
   OPT_HELP,
   OPT_NONEW,
   OPT_SELF,
@@ -361,10 +592,14 @@ enum opttag {
 static const struct option muchsync_options[] = {
   { "version", no_argument, nullptr, OPT_VERSION },
   { "server", no_argument, nullptr, OPT_SERVER },
+  { "daemon", no_argument, nullptr, OPT_DAEMON },
   { "noscan", no_argument, nullptr, OPT_NOSCAN },
   { "upbg", no_argument, nullptr, OPT_UPBG },
   { "noup", no_argument, nullptr, OPT_NOUP },
   { "noupload", no_argument, nullptr, OPT_NOUP },
+  { "overlap", no_argument, nullptr, OPT_OVERLAP },
+  { "channels", required_argument, nullptr, OPT_CHANNELS },
+  { "continuous", no_argument, nullptr, OPT_CONTINUOUS },
   { "nonew", no_argument, nullptr, OPT_NONEW },
   { "init", required_argument, nullptr, OPT_INIT },
   { "self", no_argument, nullptr, OPT_SELF },
@@ -408,6 +643,9 @@ main(int argc, char **argv)
     case OPT_SERVER:
       opt_server = true;
       break;
+    case OPT_DAEMON:
+      opt_daemon = true;
+      break;
     case OPT_NOSCAN:
       opt_noscan = true;
       break;
@@ -417,6 +655,17 @@ main(int argc, char **argv)
     case OPT_NOUP:
       opt_noup = true;
       break;
+    case OPT_OVERLAP:
+      opt_overlap = true;
+      break;
+    case OPT_CONTINUOUS:
+      opt_continuous = true;
+      break;
+    case OPT_CHANNELS:
+      opt_channels = atoi(optarg);
+      if (opt_channels < 1)
+	usage();
+      break;
     case OPT_NONEW:
       opt_nonew = true;
       break;
@@ -436,10 +685,19 @@ main(int argc, char **argv)
   if (opt_self)
     print_self();
   else if (opt_server) {
-    if (opt_init || opt_noup || opt_upbg || optind != argc)
+    if (opt_init || opt_noup || opt_upbg || opt_overlap || opt_channels > 1
+	|| opt_continuous || optind != argc)
       usage();
     server();
   }
+  else if (opt_daemon) {
+    if (opt_init || opt_noup || opt_upbg || opt_overlap || opt_channels > 1
+	|| opt_continuous || opt_noscan || optind != argc)
+      usage();
+    run_daemon();
+  }
+  else if (opt_continuous && (opt_noup || opt_upbg))
+    usage();
   else if (opt_upbg) {
     int fds[2];
     if (pipe(fds)) {
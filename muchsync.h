@@ -1,9 +1,12 @@
 // -*- C++ -*-
 
+#include <condition_variable>
 #include <istream>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "cleanup.h"
 #include "sql_db.h"
@@ -12,22 +15,65 @@
 using std::string;
 
 /* protocol.cc */
-void muchsync_server(sqlite3 *db, notmuch_db &nm);
+class msg_sync;
+/** What a server keeps open from one session to the next.  With
+ *  --daemon, each session runs in a thread of its own, and sessions
+ *  and the daemon's background scans take turns with the databases by
+ *  holding lock. */
+struct server_state {
+  sqlite3 *const db;
+  notmuch_db &nm;
+  std::mutex lock;
+  std::condition_variable changed; // Notified when scanned changes
+  i64 scanned = 0;		   // Xapian fingerprint as of last scan
+  bool rescanning = false;	   // Someone keeps calling scan()
+  std::unique_ptr<msg_sync> msync;
+  server_state(sqlite3 *db, notmuch_db &nm);
+  server_state(const server_state &) = delete;
+  ~server_state();
+  /** Bring db up to date with Xapian, unless force is false and Xapian
+   *  has not changed since the last scan.  Caller must hold lock. */
+  void scan(bool force = false);
+};
+void muchsync_server(server_state &st, std::istream &in, std::ostream &out);
 void muchsync_client(sqlite3 *db, notmuch_db &nm,
-		     std::istream &in, std::ostream &out);
+		     std::istream &in, std::ostream &out,
+		     const string &greeting = string());
 std::istream &get_response(std::istream &in, string &line, bool err_ok = true);
 
+/** A snapshot of a server's replica, from which --init populates a
+ *  new one (see fetch_image and apply_image). */
+struct replica_image {
+  versvector vv;
+  std::vector<hash_info> links;
+  /* Tag records as received: reading them interns their tag names,
+   * which needs state.db, and that is only opened after notmuch new
+   * has indexed the image. */
+  std::vector<string> tags;
+};
+/* Fetch the server's files into maildir, if greeting offers image */
+bool fetch_image(std::istream &in, std::ostream &out, const string &greeting,
+		 const string &maildir, replica_image &img);
+/* Index and adopt an image, once notmuch new has seen its files */
+void apply_image(sqlite3 *db, notmuch_db &nm, const replica_image &img);
+
 /* muchsync.cc */
 extern bool opt_fullscan;
 extern bool opt_noscan;
 extern bool opt_upbg;
 extern int opt_upbg_fd;
 extern bool opt_noup;
+extern bool opt_overlap;
+extern int opt_channels;
+extern bool opt_continuous;
 extern string opt_ssh;
 extern string opt_remote_muchsync_path;
 extern string opt_notmuch_config;
 extern const char muchsync_trashdir[];
 extern const char muchsync_tmpdir[];
+void open_channel(int fds[2]);
 
 /* xapian_sync.cc */
 void sync_local_data(sqlite3 *sqldb, const string &maildir);
+i64 xapian_fingerprint(const string &maildir);
+int xapian_watch(const string &maildir);
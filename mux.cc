@@ -0,0 +1,270 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#include "mux.h"
+
+using namespace std;
+
+/* An output buffer that also wakes up the mux writer thread. */
+class mux_outbuf : public infinibuf_mt {
+  mux::state *s_;
+protected:
+  void notempty() override;
+public:
+  explicit mux_outbuf(mux::state *s) : infinibuf_mt(0), s_(s) {}
+  /** Bytes not yet drained; caller must hold the lock. */
+  size_t queued() {
+    return (data_.size() - 1) * chunksize_ + ppos_ - gpos_;
+  }
+};
+
+struct mux::state {
+  streambuf *rawin;
+  streambuf *rawout;
+  mutex m;
+  condition_variable wake;	// Writer waits here for output
+  condition_variable moved;	// throttle and await wait here
+  bool pending = false;		// Output arrived since writer last looked
+  bool dead = false;		// Writer cannot write any more
+  unsigned long gen = 0;	// Incremented each time either thread
+				// moves data
+  shared_ptr<infinibuf_mt> in[nstreams];
+  shared_ptr<mux_outbuf> out[nstreams];
+};
+
+void
+mux_outbuf::notempty()
+{
+  infinibuf_mt::notempty();
+  lock_guard<mutex> _lk (s_->m);
+  s_->pending = true;
+  s_->wake.notify_one();
+}
+
+static void
+send_frame(streambuf *sb, int stream, const char *p, size_t n)
+{
+  char hdr[4] = { char(stream), char(n >> 16), char(n >> 8), char(n) };
+  if (sb->sputn(hdr, sizeof(hdr)) != sizeof(hdr)
+      || (n && sb->sputn(p, n) != streamsize(n)))
+    throw runtime_error ("mux: write failed");
+}
+
+/* Writes out at most max bytes of stream i, or an end-of-stream frame
+ * if the stream is finished.  Returns the number of bytes written, or
+ * -1 after writing end-of-stream. */
+static int
+drain(mux::state *s, int i, int max)
+{
+  infinibuf &ib = *s->out[i];
+  unique_lock<infinibuf> lk (ib);
+  int n = min(ib.gsize(), max);
+  if (n == 0) {
+    if (!ib.eof())
+      return 0;
+    lk.unlock();
+    send_frame(s->rawout, i, nullptr, 0);
+    return -1;
+  }
+  char *p = ib.gptr();
+  lk.unlock();
+  send_frame(s->rawout, i, p, n);
+  lk.lock();
+  ib.gbump(n);
+  return n;
+}
+
+static void
+write_loop(shared_ptr<mux::state> s)
+{
+  bool done[mux::nstreams] = { false, false };
+  try {
+    while (!done[mux::control] || !done[mux::bulk]) {
+      {
+	lock_guard<mutex> _lk (s->m);
+	s->pending = false;
+      }
+      bool wrote = false;
+      int n;
+      while (!done[mux::control]
+	     && (n = drain(s.get(), mux::control, INT_MAX)) != 0) {
+	if (n < 0)
+	  done[mux::control] = true;
+	wrote = true;
+      }
+      if (wrote)
+	s->rawout->pubsync();
+      if (!done[mux::bulk]
+	  && (n = drain(s.get(), mux::bulk, mux::bulk_frame)) != 0) {
+	if (n < 0)
+	  done[mux::bulk] = true;
+	wrote = true;
+      }
+      if (wrote) {
+	lock_guard<mutex> _lk (s->m);
+	s->gen++;
+	s->moved.notify_all();
+	continue;
+      }
+      s->rawout->pubsync();
+      unique_lock<mutex> lk (s->m);
+      while (!s->pending)
+	s->wake.wait(lk);
+    }
+    s->rawout->pubsync();
+  }
+  catch (const runtime_error &) {
+    for (auto ob : s->out) {
+      lock_guard<infinibuf> _lk (*ob);
+      ob->err(EPIPE);
+    }
+  }
+  lock_guard<mutex> _lk (s->m);
+  s->dead = true;
+  s->moved.notify_all();
+}
+
+/* Copies len bytes from sb into ib. */
+static bool
+read_payload(streambuf *sb, infinibuf &ib, size_t len)
+{
+  unique_lock<infinibuf> lk (ib);
+  while (len > 0) {
+    char *p = ib.pptr();
+    size_t n = min(len, size_t(ib.psize()));
+    lk.unlock();
+    bool ok = sb->sgetn(p, n) == streamsize(n);
+    lk.lock();
+    if (!ok) {
+      ib.err(EPIPE);
+      return false;
+    }
+    ib.pbump(n);
+    len -= n;
+  }
+  return true;
+}
+
+static void
+note_input(mux::state *s)
+{
+  lock_guard<mutex> _lk (s->m);
+  s->gen++;
+  s->moved.notify_all();
+}
+
+static void
+read_loop(shared_ptr<mux::state> s)
+{
+  bool done[mux::nstreams] = { false, false };
+  char hdr[4];
+  while ((!done[mux::control] || !done[mux::bulk])
+	 && s->rawin->sgetn(hdr, sizeof(hdr)) == sizeof(hdr)) {
+    unsigned i = static_cast<unsigned char>(hdr[0]);
+    size_t len = static_cast<unsigned char>(hdr[1]) << 16
+      | static_cast<unsigned char>(hdr[2]) << 8
+      | static_cast<unsigned char>(hdr[3]);
+    if (i >= mux::nstreams || done[i])
+      break;
+    infinibuf &ib = *s->in[i];
+    if (len == 0) {
+      lock_guard<infinibuf> _lk (ib);
+      ib.peof();
+      done[i] = true;
+      note_input(s.get());
+      continue;
+    }
+    if (!read_payload(s->rawin, ib, len))
+      break;
+    note_input(s.get());
+  }
+  for (auto ib : s->in) {
+    lock_guard<infinibuf> _lk (*ib);
+    ib->peof();
+  }
+  note_input(s.get());
+}
+
+mux::mux(streambuf *rawin, streambuf *rawout)
+  : s_(make_shared<state>())
+{
+  s_->rawin = rawin;
+  s_->rawout = rawout;
+  for (int i = 0; i < nstreams; i++) {
+    s_->in[i] = make_shared<infinibuf_mt>();
+    s_->out[i] = make_shared<mux_outbuf>(s_.get());
+    in_[i].reset(new infinistreambuf(s_->in[i]));
+    out_[i].reset(new infinistreambuf(s_->out[i]));
+  }
+  reader_ = thread(read_loop, s_);
+  writer_ = thread(write_loop, s_);
+}
+
+mux::~mux()
+{
+  for (auto &sb : out_)
+    sb->sputeof();
+  if (uncaught_exception()) {
+    reader_.detach();
+    writer_.detach();
+  }
+  else {
+    writer_.join();
+    reader_.join();
+  }
+}
+
+void
+mux::throttle(stream i, size_t max)
+{
+  out_[i]->pubsync();
+  for (;;) {
+    unsigned long gen;
+    {
+      lock_guard<mutex> _lk (s_->m);
+      if (s_->dead)
+	return;
+      gen = s_->gen;
+    }
+    {
+      lock_guard<infinibuf> _lk (*s_->out[i]);
+      if (s_->out[i]->queued() <= max)
+	return;
+    }
+    unique_lock<mutex> lk (s_->m);
+    while (gen == s_->gen && !s_->dead)
+      s_->moved.wait(lk);
+  }
+}
+
+size_t
+mux::queued(stream i)
+{
+  lock_guard<infinibuf> _lk (*s_->out[i]);
+  return s_->out[i]->queued();
+}
+
+void
+mux::await(stream in, stream out, size_t max)
+{
+  out_[out]->pubsync();
+  for (;;) {
+    unsigned long gen;
+    {
+      lock_guard<mutex> _lk (s_->m);
+      gen = s_->gen;
+    }
+    if (in_[in]->in_avail() != 0 || queued(out) <= max)
+      return;
+    unique_lock<mutex> lk (s_->m);
+    if (s_->dead)
+      return;
+    while (gen == s_->gen && !s_->dead)
+      s_->moved.wait(lk);
+  }
+}
@@ -0,0 +1,65 @@
+// -*- C++ -*-
+
+#ifndef _MUX_H_
+#define _MUX_H_ 1
+
+/** \file mux.h
+ *  \brief Two byte streams framed over a single connection.
+ */
+
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "infinibuf.h"
+
+/** \brief Multiplexes a control stream and a bulk stream over one
+ *  pair of `streambuf`s.
+ *
+ * In each direction, data travels in frames consisting of a one-byte
+ * stream number, a three-byte big-endian length, and that many bytes
+ * of payload.  A zero-length frame marks the end of a stream.
+ *
+ * A writer thread drains all pending control output before each
+ * bulk frame, and bulk frames are small, so control messages never
+ * wait behind more than one bulk frame.  A reader thread sorts
+ * incoming frames into one unbounded buffer per stream.  Both threads
+ * exit once the end of both streams has been sent (respectively
+ * received), so the underlying `streambuf`s must outlive the `mux`.
+ */
+class mux {
+public:
+  enum stream { control = 0, bulk = 1 };
+  static constexpr int nstreams = 2;
+  static constexpr int bulk_frame = 0x4000;
+  struct state;
+
+private:
+  std::shared_ptr<state> s_;
+  std::unique_ptr<infinistreambuf> in_[nstreams];
+  std::unique_ptr<infinistreambuf> out_[nstreams];
+  std::thread reader_;
+  std::thread writer_;
+
+public:
+  mux(std::streambuf *rawin, std::streambuf *rawout);
+  mux(const mux &) = delete;
+  /** Ends both output streams and, unless an exception is in flight,
+   *  waits for the peer to end both of its streams. */
+  ~mux();
+  mux &operator=(const mux &) = delete;
+
+  std::streambuf *in(stream s) { return in_[s].get(); }
+  std::streambuf *out(stream s) { return out_[s].get(); }
+  /** Flush output stream `s` and wait until no more than `max` bytes
+   *  of it remain to be written. */
+  void throttle(stream s, size_t max);
+  /** Bytes of output stream `s` not yet written. */
+  size_t queued(stream s);
+  /** Flush output stream `out` and wait until input stream `in` has
+   *  data (or has ended), or until no more than `max` bytes of `out`
+   *  remain to be written, whichever comes first. */
+  void await(stream in, stream out, size_t max);
+};
+
+#endif /* !_MUX_H_ */
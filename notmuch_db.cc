@@ -61,7 +61,8 @@ notmuch_db::add_message(const string &path, const tags_t *newtags,
   err = notmuch_database_add_message(notmuch(), path.c_str(), &message);
   if (err != NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) {
     nmtry("notmuch_database_add_message", err);
-    set_tags(message, newtags ? *newtags : new_tags);
+    // The new file's name need not match its tags yet
+    set_tags(message, newtags ? *newtags : new_tags, true);
   }
   if (was_new)
     *was_new = err != NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
@@ -77,16 +78,45 @@ notmuch_db::remove_message(const string &path)
     nmtry("notmuch_database_remove_message", err);
 }
 
+/* Tags that notmuch_message_tags_to_maildir_flags maps to flags */
+static const unordered_set<string> flag_tags {
+  "draft", "flagged", "passed", "replied", "unread"
+};
+
 void
-notmuch_db::set_tags(notmuch_message_t *msg, const tags_t &tags)
+notmuch_db::set_tags(notmuch_message_t *msg, const tags_t &tags,
+		     bool force_flags)
 {
+  tags_t old;
+  {
+    unique_obj<notmuch_tags_t, notmuch_tags_destroy>
+      ti (notmuch_message_get_tags(msg));
+    for (; notmuch_tags_valid(ti); notmuch_tags_move_to_next(ti))
+      old.insert(notmuch_tags_get(ti));
+  }
+  vector<const string *> add, del;
+  for (const string &tag : tags)
+    if (!old.count(tag))
+      add.push_back(&tag);
+  for (const string &tag : old)
+    if (!tags.count(tag))
+      del.push_back(&tag);
+  bool flags_changed = force_flags;
+  for (auto v : {&add, &del})
+    for (const string *tag : *v)
+      flags_changed = flags_changed || flag_tags.count(*tag);
+  if (add.empty() && del.empty() && !flags_changed)
+    return;
+
   // Deliberately don't unthaw message if we throw exception
   nmtry("notmuch_message_freeze", notmuch_message_freeze(msg));
-  nmtry("notmuch_message_remove_all_tags",
-	notmuch_message_remove_all_tags(msg));
-  for (auto tag : tags)
-    nmtry("notmuch_message_add_tag", notmuch_message_add_tag(msg, tag.c_str()));
-  if (sync_flags)
+  for (const string *tag : del)
+    nmtry("notmuch_message_remove_tag",
+	  notmuch_message_remove_tag(msg, tag->c_str()));
+  for (const string *tag : add)
+    nmtry("notmuch_message_add_tag",
+	  notmuch_message_add_tag(msg, tag->c_str()));
+  if (sync_flags && flags_changed)
     nmtry("notmuch_message_maildir_flags_to_tags",
 	  notmuch_message_tags_to_maildir_flags(msg));
   nmtry("notmuch_message_thaw", notmuch_message_thaw(msg));
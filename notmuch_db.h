@@ -66,7 +66,10 @@ public:
 			const tags_t *new_tags = nullptr, 
 			bool *was_new = nullptr);
   void remove_message(const string &path);
-  void set_tags(notmuch_message_t *msg, const tags_t &tags);
+  /* Only touches the tags that differ, and the maildir flags only if
+   * a tag that maps to one changed or force_flags is set. */
+  void set_tags(notmuch_message_t *msg, const tags_t &tags,
+		bool force_flags = false);
   Xapian::docid get_dir_docid(const char *path);
 
   notmuch_database_t *notmuch();
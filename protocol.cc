@@ -1,15 +1,22 @@
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <limits>
+#include <map>
 #include <cstdio>
 #include <iomanip>
 #include <unordered_map>
 #include <unordered_set>
+#include <thread>
 #include <vector>
+#include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -18,11 +25,43 @@
 #include "misc.h"
 #include "muchsync.h"
 #include "infinibuf.h"
+#include "iblt.h"
+#include "mux.h"
 
 using namespace std;
 
 bool interrupted;
 
+/* Optional protocol features advertised after dbvers in the server's
+ * greeting.  A client may only use the ones its server lists.
+ *
+ *  resume -- "send hash offset" sends the content after the first
+ *            offset bytes, and echoes the offset after the tag_info.
+ *  mux    -- after a "mux" command, both directions carry a control
+ *            and a bulk stream framed by class mux.  The responses to
+ *            send and the message content following each recv go on
+ *            the bulk stream, everything else on control.
+ *  watch  -- "scan" rescans the maildir, and "watch" returns once the
+ *            notmuch database has changed since the last scan, or the
+ *            client has sent another command.
+ *  iblt   -- "lsync iblt" may answer 230 on a first sync, after which
+ *            "iblt table" reconciles the two sets of links.
+ *  image  -- "image" sends a snapshot of the replica and all its files.
+ *  tinfos -- "tinfos n" followed by n message IDs, one per line, sends
+ *            the tag_info of each known one, like tsync.
+ *  tagdict - after a "tagdict" command, tag_info records in both
+ *            directions may name tags by ID (see wire_codec).
+ *  dirdict - likewise, "dirdict" lets hash_info records in both
+ *            directions name directories by ID. */
+static const char server_extensions[] =
+  "resume mux watch iblt image tinfos tagdict dirdict";
+
+/* With mux, how far message content may get ahead of the network */
+static constexpr size_t bulk_backlog = 0x1000000;
+
+/* How often to check for changes with --continuous */
+static constexpr chrono::milliseconds watch_interval (250);
+
 class msg_sync {
   sqlite3 *db_;
   notmuch_db &nm_;
@@ -35,20 +74,76 @@ class msg_sync {
   sqlstmt_t add_tag_;
   sqlstmt_t update_message_id_stamp_;
   sqlstmt_t record_docid_;
+  sqlstmt_t set_file_docid_;
   std::unordered_map<string,i64> dir_ids_;
+  std::unordered_map<i64,string> dir_paths_;
+  unsigned dir_epoch_ = 0;
   std::pair<i64,i64> mystamp_;
 
+  /* A change to the notmuch index that hash_sync has put off */
+  struct index_op {
+    bool add;			// Add path, else remove it
+    string path;
+    i64 dir_docid;
+    string name;
+    string message_id;
+    bool tagged;		// Whether ti holds the message's tags
+    tag_info ti;
+  };
+  std::vector<index_op> pending_;
+  static constexpr size_t index_batch = 4096;
+
+  /* Tags that tag_sync has decided on but not yet applied, by docid */
+  struct tag_op {
+    string message_id;
+    tag_set tags;
+    writestamp stamp;
+  };
+  std::map<i64,tag_op> pending_tags_;
+  static constexpr size_t tag_batch = 4096;
+  bool defer_ = false;
+
   i64 get_dir_docid (const string &dir);
+  const string &dir_path (i64 dir_docid);
+  void load();
 public:
   hash_lookup hashdb;
   tag_lookup tagdb;
   msg_sync(notmuch_db &nm, sqlite3 *db);
+  /** Pick up a new version and directories after sync_local_data. */
+  void refresh() { load(); }
+  /** The dir_docid of a directory already in xapian_dirs, or -1, for
+   *  wire_codec::resolve_dir. */
+  i64 known_dir_docid (const string &dir) const {
+    return find_default (-1, dir_ids_, dir);
+  }
+  /** Bumped whenever the answers of known_dir_docid may change */
+  const unsigned *dir_epoch () const { return &dir_epoch_; }
+  /** Let hash_sync and tag_sync queue their changes to notmuch, so
+   *  that they get applied a batch at a time.  Off by default, which
+   *  applies each one right away, as an interactive sync wants. */
+  void defer(bool on) {
+    defer_ = on;
+    if (!on)
+      flush();
+  }
   bool hash_sync(const versvector &remote_sync_vector,
 		 const hash_info &remote_hash_info,
 		 const string *sourcefile, const tag_info *tip);
   bool tag_sync(const versvector &remote_sync_vector,
 		const tag_info &remote_tag_info);
-  void commit();
+  /** Index the files hash_sync has linked into place, and remove the
+   *  ones it has unlinked, in a single atomic notmuch transaction. */
+  void flush_index();
+  /** Apply the tags tag_sync has queued, in docid order, in a single
+   *  atomic notmuch transaction and SQLite savepoint. */
+  void flush_tags();
+  /** Must be called before committing, or before anything that reads
+   *  the notmuch database or the tags in sqlite. */
+  void flush() { flush_index(); flush_tags(); }
+  /** Forget the changes queued but not yet flushed, e.g., after the
+   *  transaction they belong to has been rolled back. */
+  void discard() { pending_.clear(); pending_tags_.clear(); }
 };
 
 static void
@@ -140,33 +235,56 @@ get_mystamp(sqlite3 *db)
 
 msg_sync::msg_sync (notmuch_db &nm, sqlite3 *db)
   : db_(db), nm_ (nm),
-    update_hash_stamp_(db_, "UPDATE maildir_hashes "
-		       "SET replica = ?, version = ? WHERE hash_id = ?;"),
-    add_file_(db_, "INSERT INTO xapian_files"
-	      " (dir_docid, name, docid, mtime, inode, hash_id)"
-	      " VALUES (?, ?, ?, ?, ?, ?);"),
-    del_file_(db, "DELETE FROM xapian_files"
-	      " WHERE (dir_docid = ?) & (name = ?);"),
-    set_link_count_(db_, "INSERT OR REPLACE INTO xapian_nlinks"
-		    " (hash_id, dir_docid, link_count) VALUES (?, ?, ?);"),
-    delete_link_count_(db_, "DELETE FROM xapian_nlinks"
-		       " WHERE (hash_id = ?) & (dir_docid = ?);"),
-    clear_tags_(db_, "DELETE FROM tags WHERE docid = ?;"),
-    add_tag_(db_, "INSERT OR IGNORE INTO tags (docid, tag) VALUES (?, ?);"),
-    update_message_id_stamp_(db_, "UPDATE message_ids SET"
-			     " replica = ?, version = ? WHERE docid = ?;"),
-    record_docid_(db_, "INSERT OR IGNORE INTO message_ids"
-		  " (message_id, docid, replica, version)"
-		  " VALUES (?, ?, 0, 0);"),
-    mystamp_(get_mystamp(db_)),
+    update_hash_stamp_(sqlstmt_t::cached
+		       (db_, "UPDATE maildir_hashes"
+			" SET replica = ?, version = ? WHERE hash_id = ?;")),
+    add_file_(sqlstmt_t::cached
+	      (db_, "INSERT INTO xapian_files"
+	       " (dir_docid, name, docid, mtime, inode, hash_id)"
+	       " VALUES (?, ?, ?, ?, ?, ?);")),
+    del_file_(sqlstmt_t::cached
+	      (db_, "DELETE FROM xapian_files"
+	       " WHERE (dir_docid = ?) & (name = ?);")),
+    set_link_count_(sqlstmt_t::cached
+		    (db_, "INSERT OR REPLACE INTO xapian_nlinks"
+		     " (hash_id, dir_docid, link_count) VALUES (?, ?, ?);")),
+    delete_link_count_(sqlstmt_t::cached
+		       (db_, "DELETE FROM xapian_nlinks"
+			" WHERE (hash_id = ?) & (dir_docid = ?);")),
+    clear_tags_(sqlstmt_t::cached (db_, "DELETE FROM tags WHERE docid = ?;")),
+    add_tag_(sqlstmt_t::cached
+	     (db_, "INSERT OR IGNORE INTO tags (docid, tag_id) VALUES (?, ?);")),
+    update_message_id_stamp_(sqlstmt_t::cached
+			     (db_, "UPDATE message_ids SET"
+			      " replica = ?, version = ? WHERE docid = ?;")),
+    record_docid_(sqlstmt_t::cached
+		  (db_, "INSERT OR IGNORE INTO message_ids"
+		   " (message_id, msgid_fp, docid, replica, version)"
+		   " SELECT ?1, ?2, ?3, 0, 0 WHERE NOT EXISTS"
+		   " (SELECT 1 FROM message_ids"
+		   " WHERE msgid_fp = ?2 AND message_id = ?1);")),
+    set_file_docid_(sqlstmt_t::cached
+		    (db_, "UPDATE xapian_files SET docid = ?"
+		     " WHERE (dir_docid = ?) & (name = ?);")),
     hashdb (nm_.maildir, db_),
     tagdb (db_)
 {
+  load();
+}
+
+void
+msg_sync::load()
+{
+  mystamp_ = get_mystamp(db_);
+  dir_ids_.clear();
+  dir_paths_.clear();
+  ++dir_epoch_;
   sqlstmt_t s (db_, "SELECT dir_path, dir_docid FROM xapian_dirs;");
   while (s.step().row()) {
     string dir {s.str(0)};
     i64 dir_id {s.integer(1)};
     dir_ids_.emplace (dir, dir_id);
+    dir_paths_.emplace (dir_id, dir);
   }
 }
 
@@ -260,13 +378,28 @@ msg_sync::get_dir_docid(const string &dir)
     return i->second;
 
   i64 dir_docid = nm_.get_dir_docid(dir.c_str());
-  sqlexec (db_, "INSERT OR REPLACE INTO xapian_dirs"
-	   " (dir_path, dir_docid, dir_mtime) VALUES (%Q, %lld, -1);",
-	   dir.c_str(), i64(dir_docid));
+  sqlexec_cached (db_, "INSERT OR REPLACE INTO xapian_dirs"
+		  " (dir_path, dir_docid, dir_mtime) VALUES (?, ?, -1);",
+		  dir, i64(dir_docid));
   dir_ids_.emplace(dir, dir_docid);
+  dir_paths_.emplace(dir_docid, dir);
   return dir_docid;
 }
 
+const string &
+msg_sync::dir_path(i64 dir_docid)
+{
+  auto i = dir_paths_.find(dir_docid);
+  if (i != dir_paths_.end())
+    return i->second;
+  // Added to xapian_dirs by a scan since load()
+  sqlstmt_t s (db_, "SELECT dir_path FROM xapian_dirs WHERE dir_docid = ?;");
+  if (!s.param(dir_docid).step().row())
+    throw runtime_error ("unknown directory docid " + to_string(dir_docid));
+  dir_ids_.emplace(s.str(0), dir_docid);
+  return dir_paths_.emplace(dir_docid, s.str(0)).first->second;
+}
+
 static void
 resolve_one_link_conflict(const unordered_map<string,i64> &a,
 			  const unordered_map<string,i64> &b,
@@ -317,8 +450,8 @@ msg_sync::hash_sync(const versvector &rvv,
 		    const tag_info *tip)
 {
   hash_info lhi;
-  i64 docid = -1;
 
+  flush_tags();
   if (hashdb.lookup(rhi.hash)) {
     /* We might already be up to date from a previous sync that never
      * completed, in which case there is nothing to do. */
@@ -329,14 +462,29 @@ msg_sync::hash_sync(const versvector &rvv,
   else
     lhi.hash = rhi.hash;
 
+  /* Everything below goes by dir_docid.  A codec that resolves
+   * directories has done so for all but the ones new here. */
+  unordered_map<i64,i64> rdirs (rhi.dir_docids);
+  for (auto i : rhi.dirs)
+    rdirs[get_dir_docid(i.first)] += i.second;
+
   bool links_conflict =
     lhi.hash_stamp.second > find_default (0, rvv, lhi.hash_stamp.first);
-  bool deleting = rhi.dirs.empty() && (!links_conflict || lhi.dirs.empty());
-
-  unordered_map<string,i64> needlinks
-    (links_conflict ? resolve_link_conflicts (lhi.dirs, rhi.dirs) : rhi.dirs);
+  bool deleting = rdirs.empty() && (!links_conflict || lhi.dir_docids.empty());
+
+  unordered_map<i64,i64> needlinks;
+  if (links_conflict) {
+    // Resolved by path, which tells cur and new apart
+    unordered_map<string,i64> rpaths;
+    for (auto i : rdirs)
+      rpaths[dir_path(i.first)] = i.second;
+    for (auto i : resolve_link_conflicts (lhi.dirs, rpaths))
+      needlinks[get_dir_docid(i.first)] = i.second;
+  }
+  else
+    needlinks = rdirs;
   bool needsource = false;
-  for (auto i : lhi.dirs)
+  for (auto i : lhi.dir_docids)
     needlinks[i.first] -= i.second;
   for (auto i : needlinks)
     if (i.second > 0) {
@@ -372,58 +520,30 @@ msg_sync::hash_sync(const versvector &rvv,
   /* add missing links */
   for (auto li : needlinks)
     for (; li.second > 0; --li.second) {
-      if (!sanity_check_path(li.first))
+      const string &dir = dir_path(li.first);
+      if (!sanity_check_path(dir))
 	break;
       string newname;
-      string target =
-	new_maildir_path(hashdb.maildir + "/" + li.first, &newname);
+      string target = new_maildir_path(hashdb.maildir + "/" + dir, &newname);
       if (link(source.c_str(), target.c_str())
 	  && (errno != ENOENT
-	      || !maildir_mkdir(hashdb.maildir + "/" + li.first)
+	      || !maildir_mkdir(hashdb.maildir + "/" + dir)
 	      || link(source.c_str(), target.c_str())))
 	  throw runtime_error (string("link (\"") + source + "\", \""
 			       + target + "\"): " + strerror(errno));
 
-      cleanup end_atomic;
-      if (tip) {
-	nm_.begin_atomic();
-	end_atomic.reset(mem_fn(&notmuch_db::end_atomic), ref(nm_));
-      }
-      bool isnew;
-      docid =
-	notmuch_db::get_docid(nm_.add_message(target,
-					      tip ? &tip->tags : nullptr,
-					      &isnew));
-      i64 dir_id = get_dir_docid(li.first);
-      add_file_.reset().param(dir_id, newname, docid, ts_to_double(sb.ST_MTIM),
-			      i64(sb.st_ino), hashdb.hash_id()).step();
-      if (isnew) {
-	record_docid_.reset().param(rhi.message_id, docid).step();
-	// tip might be NULL here when undeleting a file
-	if (tip) {
-	  update_message_id_stamp_.reset()
-	    .param(tip->tag_stamp.first, tip->tag_stamp.second, docid).step();
-	  add_tag_.reset().bind_int(1, docid);
-	  for (auto t : tip->tags)
-	    add_tag_.reset().bind_text(2, t).step();
-	}
-	else {
-	  // The empty tag is always invalid, so if worse comes to
-	  // worst and we crash at the wrong time, the next scan will
-	  // end up bumping the version number on this message ID.
-	  add_tag_.reset().param(docid, "").step();
-#if 0
-	  add_tag_.reset().bind_int(1, docid);
-	  for (auto t : nm_.new_tags)
-	    add_tag_.reset().bind_text(2, t).step();
-#endif
-	}
-      }
+      /* Record the file now, and let flush_index index it (with
+       * many others, if deferring) and fill in its docid. */
+      add_file_.reset().param(li.first, newname, nullptr,
+			      ts_to_double(sb.ST_MTIM), i64(sb.st_ino),
+			      hashdb.hash_id()).step();
+      pending_.push_back({true, target, li.first, newname, rhi.message_id,
+	    tip != nullptr, tip ? *tip : tag_info()});
     }
   /* remove extra links */
   if (!links_conflict)
     for (int i = 0, e = hashdb.nlinks(); i < e; i++) {
-      i64 &n = needlinks[hashdb.links().at(i).first];
+      i64 &n = needlinks[hashdb.link_dir_docid(i)];
       if (n < 0) {
 	string path = hashdb.link_path(i);
 	bool err;
@@ -448,10 +568,9 @@ msg_sync::hash_sync(const versvector &rvv,
 	}
 	if (!err) {
 	  ++n;
-	  auto df = hashdb.links()[i];
-	  i64 dir_docid = get_dir_docid(df.first);
-	  del_file_.reset().param(dir_docid, df.second).step();
-	  nm_.remove_message(path);
+	  del_file_.reset().param(hashdb.link_dir_docid(i),
+				  hashdb.links()[i].second).step();
+	  pending_.push_back({false, path});
 	}
       }
     }
@@ -459,77 +578,260 @@ msg_sync::hash_sync(const versvector &rvv,
   /* Adjust link counts in database */
   for (auto li : save_needlinks)
     if (li.second != 0) {
-      i64 dir_docid = get_dir_docid(li.first);
-      i64 newcount = find_default(0, lhi.dirs, li.first) + li.second;
+      i64 newcount = find_default(0, lhi.dir_docids, li.first) + li.second;
       if (newcount > 0)
 	set_link_count_.reset()
-	  .param(hashdb.hash_id(), dir_docid, newcount).step();
+	  .param(hashdb.hash_id(), li.first, newcount).step();
       else
-	delete_link_count_.reset().param(hashdb.hash_id(), dir_docid).step();
+	delete_link_count_.reset().param(hashdb.hash_id(), li.first).step();
     }
 
   if (clean_trash)
     unlink (trashname(hashdb.maildir, rhi.hash).c_str());
+  if (!defer_ || pending_.size() >= index_batch)
+    flush_index();
   return true;
 }
 
+void
+msg_sync::flush_index()
+{
+  if (pending_.empty())
+    return;
+  // Taken out first, so that a failure does not leave them to be
+  // replayed by the next flush
+  vector<index_op> ops;
+  ops.swap(pending_);
+
+  sqlexec_cached (db_, "SAVEPOINT index_sync;");
+  cleanup _rollback ([this]() {
+      sqlite3_exec (db_, "ROLLBACK TO index_sync; RELEASE index_sync;",
+		    nullptr, nullptr, nullptr);
+      load_tag_names (db_);
+    });
+  /* notmuch cannot abandon an atomic section, so on error it keeps
+   * whatever got indexed, and the next scan records that. */
+  nm_.begin_atomic();
+  cleanup _atomic ([this]() {
+      try { nm_.end_atomic(); } catch (const exception &) {}
+    });
+  for (const index_op &op : ops) {
+    if (!op.add) {
+      nm_.remove_message(op.path);
+      continue;
+    }
+    bool isnew;
+    notmuch_db::tags_t tags;
+    if (op.tagged)
+      tags = op.ti.tags.names(db_);
+    i64 docid =
+      notmuch_db::get_docid(nm_.add_message(op.path,
+					    op.tagged ? &tags : nullptr,
+					    &isnew));
+    set_file_docid_.reset().param(docid, op.dir_docid, op.name).step();
+    if (isnew) {
+      record_docid_.reset()
+	.param(op.message_id, msgid_fp(op.message_id), docid).step();
+      // Untagged when undeleting a file
+      if (op.tagged) {
+	update_message_id_stamp_.reset()
+	  .param(op.ti.tag_stamp.first, op.ti.tag_stamp.second, docid).step();
+	add_tag_.reset().bind_int(1, docid);
+	for (tag_id t : op.ti.tags)
+	  add_tag_.reset().bind_int(2, t).step();
+      }
+      else {
+	// The empty tag is always invalid, so if worse comes to
+	// worst and we crash at the wrong time, the next scan will
+	// end up bumping the version number on this message ID.
+	add_tag_.reset().param(docid, intern_tag(db_, "")).step();
+      }
+    }
+  }
+  _atomic.release();
+  nm_.end_atomic();
+  _rollback.release();
+  sqlexec_cached (db_, "RELEASE index_sync;");
+}
+
+/* Decides on the new tags right away, so the result is the same as
+ * applying them one message at a time, but leaves applying them to
+ * flush_tags. */
 bool
 msg_sync::tag_sync(const versvector &rvv, const tag_info &rti)
 {
+  // New messages must be indexed before they can be tagged
+  flush_index();
   if (!tagdb.lookup(rti.message_id)) {
     cerr << "warning: can't find " << rti.message_id << '\n';
     return false;
   }
+  if (pending_tags_.count(tagdb.docid())) {
+    flush_tags();
+    tagdb.lookup(rti.message_id);
+  }
   const tag_info &lti = tagdb.info();
   if (lti.tag_stamp == rti.tag_stamp)
     return true;
 
-  sqlexec (db_, "SAVEPOINT tag_sync;");
-  cleanup c (sqlexec, db_, "ROLLBACK TO tag_sync;");
-
-  notmuch_db::message_t msg = nm_.get_message (rti.message_id.c_str());
-  assert (tagdb.docid() == nm_.get_docid(msg));
-
   bool tags_conflict
     = lti.tag_stamp.second > find_default (0, rvv, lti.tag_stamp.first);
-  unordered_set<string> newtags (rti.tags);
+  tag_set newtags (rti.tags);
   if (tags_conflict) {
     // Logically OR most tags
-    for (auto i : lti.tags)
+    for (tag_id i : lti.tags)
       newtags.insert(i);
     // But logically AND new_tags
-    for (auto i : nm_.new_tags)
-      if (rti.tags.find(i) == rti.tags.end()
-	  || lti.tags.find(i) == lti.tags.end())
+    for (const string &name : nm_.new_tags) {
+      tag_id i = intern_tag(db_, name);
+      if (!rti.tags.count(i) || !lti.tags.count(i))
 	newtags.erase(i);
+    }
   }
 
-  nm_.set_tags(msg, newtags);
-
   const writestamp *wsp = tags_conflict ? &mystamp_ : &rti.tag_stamp;
-  update_message_id_stamp_.reset()
-    .param(wsp->first, wsp->second, tagdb.docid())
-    .step();
-  clear_tags_.reset().param(tagdb.docid()).step();
-  add_tag_.reset().bind_int(1, tagdb.docid());
-  for (auto t : newtags)
-    add_tag_.reset().bind_text(2, t).step();
-
-  c.release();
-  sqlexec (db_, "RELEASE tag_sync;");
+  pending_tags_.emplace(tagdb.docid(),
+			tag_op { rti.message_id, move(newtags), *wsp });
+  if (!defer_ || pending_tags_.size() >= tag_batch)
+    flush_tags();
   return true;
 }
 
+void
+msg_sync::flush_tags()
+{
+  if (pending_tags_.empty())
+    return;
+  std::map<i64,tag_op> ops;
+  ops.swap(pending_tags_);
+
+  sqlexec_cached (db_, "SAVEPOINT tag_sync;");
+  cleanup _rollback ([this]() {
+      sqlite3_exec (db_, "ROLLBACK TO tag_sync; RELEASE tag_sync;",
+		    nullptr, nullptr, nullptr);
+      load_tag_names (db_);
+    });
+  nm_.begin_atomic();
+  cleanup _atomic ([this]() {
+      try { nm_.end_atomic(); } catch (const exception &) {}
+    });
+  /* Each message is still found by its ID:  notmuch cannot look one
+   * up by docid, and a query ORing a batch of IDs makes Xapian do the
+   * same term lookups, plus quoting every ID for the query parser. */
+  for (const auto &p : ops) {
+    i64 docid = p.first;
+    const tag_op &op = p.second;
+    notmuch_db::message_t msg = nm_.get_message (op.message_id.c_str());
+    assert (docid == nm_.get_docid(msg));
+    nm_.set_tags(msg, op.tags.names(db_));
+
+    update_message_id_stamp_.reset()
+      .param(op.stamp.first, op.stamp.second, docid).step();
+    clear_tags_.reset().param(docid).step();
+    add_tag_.reset().bind_int(1, docid);
+    for (tag_id t : op.tags)
+      add_tag_.reset().bind_int(2, t).step();
+  }
+  _atomic.release();
+  nm_.end_atomic();
+
+  _rollback.release();
+  sqlexec_cached (db_, "RELEASE tag_sync;");
+}
+
+static string
+partial_path (const string &maildir, const string &hash)
+{
+  if (!hash_ok(hash))
+    throw runtime_error ("illegal hash: " + hash);
+  return maildir + muchsync_tmpdir + "/" + hash + ".part";
+}
+
+/* Returns the number of bytes of a message already downloaded by an
+ * earlier session that was cut short, or 0 if there is nothing
+ * usable to resume from. */
+static i64
+partial_length (const string &maildir, const hash_info &hi)
+{
+  string path = partial_path(maildir, hi.hash);
+  struct stat sb;
+  if (stat(path.c_str(), &sb) || !S_ISREG(sb.st_mode))
+    return 0;
+  if (sb.st_size > hi.size) {
+    unlink(path.c_str());
+    return 0;
+  }
+  return sb.st_size;
+}
+
+/* Once every missing message has been received, any partial file
+ * left over belongs to content we no longer want. */
+static void
+clean_partials (const string &maildir)
+{
+  string dir = maildir + muchsync_tmpdir;
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return;
+  cleanup _closedir (closedir, d);
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    size_t len = strlen(e->d_name);
+    if (len > 5 && !strcmp(e->d_name + len - 5, ".part"))
+      unlinkat(dirfd(d), e->d_name, 0);
+  }
+}
+
+static bool
+hash_prefix (const string &path, i64 len, hash_ctx &ctx)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  cleanup _close (close, fd);
+  char buf[16384];
+  while (len > 0) {
+    int n = read(fd, buf, min<i64>(sizeof(buf), len));
+    if (n <= 0)
+      return false;
+    ctx.update(buf, n);
+    len -= n;
+  }
+  return true;
+}
+
+/* Receive the content of a message, of which the peer sends
+ * everything after the first offset bytes.  With partial set, the
+ * file is named after the content hash and left in the tmp directory
+ * if the transfer is interrupted, so that a later session can resume
+ * from wherever this one stopped.  If the first offset bytes are no
+ * longer there to resume from, skips the body, removes the partial
+ * file, and returns an empty path, so the caller can ask for the
+ * whole message again. */
 static string
-receive_message (istream &in, const hash_info &hi, const string &maildir)
+receive_message (istream &in, const hash_info &hi, const string &maildir,
+		 bool partial = false, i64 offset = 0)
 {
-  string path (maildir + muchsync_tmpdir + "/" + maildir_name());
-  ofstream tmp (path, ios_base::out|ios_base::trunc);
+  string path (partial ? partial_path(maildir, hi.hash)
+	       : maildir + muchsync_tmpdir + "/" + maildir_name());
+  hash_ctx ctx;
+  bool resumed = offset > 0
+    && !truncate(path.c_str(), offset) && hash_prefix(path, offset, ctx);
+  ofstream tmp (path, resumed ? ios_base::out|ios_base::app
+		: ios_base::out|ios_base::trunc);
   if (!tmp.is_open())
     throw runtime_error (path + ": " + strerror(errno));
   cleanup _unlink (unlink, path.c_str());
-  i64 size = hi.size;
-  hash_ctx ctx;
+  if (offset > 0 && !resumed) {
+    // The peer won't send the bytes we lost, so drop this copy
+    in.ignore(hi.size - offset);
+    if (!in.good())
+      throw runtime_error ("premature EOF receiving message");
+    return string();
+  }
+  if (partial)
+    _unlink.release();
+  i64 size = hi.size - offset;
   while (size > 0) {
     char buf[16384];
     int n = min<i64>(sizeof(buf), size);
@@ -544,8 +846,10 @@ receive_message (istream &in, const hash_info &hi, const string &maildir)
     size -= n;
   }
   tmp.close();
-  if (ctx.final() != hi.hash)
+  if (ctx.final() != hi.hash) {
+    unlink(path.c_str());
     throw runtime_error ("message received does not match hash");
+  }
   _unlink.release();
   return path;
 }
@@ -559,9 +863,7 @@ CREATE TEMP TABLE IF NOT EXISTS peer_vector (
   known_version INTEGER);
 DELETE FROM peer_vector;
 INSERT OR REPLACE INTO peer_vector
-  SELECT DISTINCT replica, 0 FROM message_ids;
-INSERT OR REPLACE INTO peer_vector
-  SELECT DISTINCT replica, 0 FROM maildir_hashes;
+  SELECT replica, 0 FROM replicas WHERE refcount > 0;
 )");
   sqlstmt_t pvadd (sqldb, "INSERT OR REPLACE INTO"
 		   " peer_vector (replica, known_version) VALUES (?, ?);");
@@ -579,104 +881,272 @@ SELECT replica, p.known_version
   WHERE ifnull (s.version, 0) < p.known_version)");
 }
 
-static i64
-send_links (sqlite3 *sqldb, const string &prefix, ostream &out)
+/* Identifies a hash together with its link counts, but not its
+ * writestamp, so two replicas holding the same links for a message
+ * compute the same digest. */
+static uint64_t
+link_digest (const hash_info &hi)
 {
-  unordered_map<i64,string> dirs;
-  {
-    sqlstmt_t d (sqldb, "SELECT dir_docid, dir_path FROM xapian_dirs;");
-    while (d.step().row())
-      dirs.emplace (d.integer(0), d.str(1));
+  map<string,i64> dirs (hi.dirs.begin(), hi.dirs.end());
+  hash_ctx ctx;
+  ctx.update(hi.hash.data(), hi.hash.size() + 1);
+  for (auto d : dirs) {
+    string count = to_string(d.second);
+    ctx.update(d.first.data(), d.first.size() + 1);
+    ctx.update(count.data(), count.size() + 1);
   }
+  return stoull(ctx.final().substr(0, 16), nullptr, 16);
+}
 
-  sqlstmt_t changed (sqldb, R"(
-SELECT h.hash_id, hash, size, message_id, h.replica, h.version,
-       dir_docid, link_count
-FROM (peer_vector p JOIN maildir_hashes h
-      ON ((p.replica = h.replica) & (p.known_version < h.version)))
-LEFT OUTER JOIN xapian_nlinks USING (hash_id);)");
-  
+/* Write the journal records of the given kind that the peer has not
+ * seen, i.e., one writestamp range per replica in peer_vector.  If
+ * only is non-null, skip links whose hash is not in it. */
+static i64
+send_journal (sqlite3 *sqldb, const char *kind, const string &prefix,
+	      ostream &out, const unordered_set<string> *only = nullptr)
+{
+  flush_journal (sqldb);
+  typed_stmt<sqlparams<const char *>, sqlcolumns<sqlbytes>> changed (sqldb, R"(
+SELECT j.record
+FROM peer_vector p CROSS JOIN change_journal j
+     ON j.kind = ? AND j.replica = p.replica AND j.version > p.known_version;)");
   i64 count = 0;
-  hash_info hi;
-  changed.step();
-  while (changed.row()) {
-    i64 hash_id = changed.integer(0);
-    hi.hash = changed.str(1);
-    hi.size = changed.integer(2);
-    hi.message_id = changed.str(3);
-    hi.hash_stamp.first = changed.integer(4);
-    hi.hash_stamp.second = changed.integer(5);
-    hi.dirs.clear();
-    if (changed.null(6))
-      changed.step();
+  /* Tag records are in the plain form, so re-encode them if out
+   * abbreviates them.  Link records name directories by dir_docid,
+   * which put_journal_link spells out as out needs. */
+  wire_codec *codec = get_wire_codec (out);
+  bool reencode = *kind == 'T' && codec && codec->tags;
+  wire_codec journal;
+  if (*kind == 'L')
+    journal = journal_codec (sqldb, codec ? codec->local_dirs : nullptr);
+  record_parser rp;
+  string rec;
+  tag_info ti;
+  for (changed.run(kind); changed.row(); changed.step()) {
+    sqlbytes r = changed.get<0>();
+    if (*kind == 'L') {
+      r.assign_to(&rec);
+      // The hash is the second field
+      if (only && !only->count(rec.substr(2, rec.find(' ', 2) - 2)))
+	continue;
+      put_journal_link (out << prefix, rec, journal);
+      out << '\n';
+      if (opt_verbose > 3)
+	cerr << prefix << rec << '\n';
+    }
+    else if (reencode) {
+      r.assign_to(&rec);
+      if (!rp.reset(rec).parse(ti))
+	throw runtime_error ("corrupt change_journal record");
+      out << prefix << ti << '\n';
+      if (opt_verbose > 3)
+	cerr << prefix << ti << '\n';
+    }
     else {
-      hi.dirs.emplace(dirs[changed.integer(6)], changed.integer(7));
-      while (changed.step().row() && changed.integer(0) == hash_id)
-	hi.dirs.emplace(dirs[changed.integer(6)], changed.integer(7));
+      (out << prefix).write(r.data, r.size) << '\n';
+      if (opt_verbose > 3)
+	(cerr << prefix).write(r.data, r.size) << '\n';
     }
-    out << prefix << hi << '\n';
-    if (opt_verbose > 3)
-      cerr << prefix << hi << '\n';
     count++;
   }
   return count;
 }
 
+static i64
+send_links (sqlite3 *sqldb, const string &prefix, ostream &out,
+	    const unordered_set<string> *only = nullptr)
+{
+  return send_journal (sqldb, "L", prefix, out, only);
+}
+
 static i64
 send_tags (sqlite3 *sqldb, const string &prefix, ostream &out)
 {
-  sqlstmt_t changed (sqldb, R"(
-SELECT m.docid, m.message_id, m.replica, m.version, tags.tag
-FROM (peer_vector p JOIN message_ids m
-      ON ((p.replica = m.replica) & (p.known_version < m.version)))
-      LEFT OUTER JOIN tags USING (docid);)");
+  return send_journal (sqldb, "T", prefix, out);
+}
 
-  tag_info ti;
-  changed.step();
-  i64 count = 0;
-  while (changed.row()) {
-    i64 docid = changed.integer(0);
-    ti.message_id = changed.str(1);
-    ti.tag_stamp.first = changed.integer(2);
-    ti.tag_stamp.second = changed.integer(3);
-    ti.tags.clear();
-    if (changed.null(4))
-      changed.step();
-    else {
-      ti.tags.insert (changed.str(4));
-      while (changed.step().row() && changed.integer(0) == docid)
-	ti.tags.insert (changed.str(4));
-    }
-    out << prefix << ti << '\n';
-    if (opt_verbose > 3)
-      cerr << prefix << ti << '\n';
-    count++;
+static i64
+count_links (sqlite3 *sqldb)
+{
+  flush_journal (sqldb);
+  sqlstmt_t s (sqldb, "SELECT count(*) FROM change_journal WHERE kind = 'L';");
+  return s.step().integer(0);
+}
+
+/* Insert the digest of every link record into a table of ncells. */
+static iblt
+link_iblt (sqlite3 *sqldb, size_t ncells)
+{
+  flush_journal (sqldb);
+  iblt t (ncells);
+  wire_codec journal = journal_codec (sqldb);
+  record_parser rp (&journal);
+  hash_info hi;
+  sqlstmt_t s (sqldb, "SELECT record FROM change_journal WHERE kind = 'L';");
+  while (s.step().row()) {
+    if (!rp.reset(s.str(0)).parse(hi))
+      throw runtime_error ("corrupt change_journal record");
+    t.insert(link_digest(hi));
   }
-  return count;
+  return t;
 }
 
+/* The hashes of the link records whose digests are in digests.  Once
+ * either side applies the other's links, the digest of a merged
+ * record no longer matches, but its hash still says which messages
+ * the peer needs to hear about. */
+static unordered_set<string>
+digest_hashes (sqlite3 *sqldb, const unordered_set<uint64_t> &digests)
+{
+  flush_journal (sqldb);
+  unordered_set<string> ret;
+  wire_codec journal = journal_codec (sqldb);
+  record_parser rp (&journal);
+  hash_info hi;
+  string rec;
+  sqlstmt_t s (sqldb, "SELECT record FROM change_journal WHERE kind = 'L';");
+  while (s.step().row()) {
+    rec = s.str(0);
+    if (!rp.reset(rec).parse(hi))
+      throw runtime_error ("corrupt change_journal record");
+    if (digests.count(link_digest(hi)))
+      ret.insert(hi.hash);
+  }
+  return ret;
+}
+
+/* True if neither version vector has seen any writestamp the other
+ * has, i.e., the two replicas are syncing for the first time.  Both
+ * sides compute the same answer from the two vectors. */
+static bool
+first_sync (const versvector &a, const versvector &b)
+{
+  for (auto ws : b)
+    if (ws.second > 0 && find_default (0, a, ws.first) > 0)
+      return false;
+  return true;
+}
+
+/* If offsetp is non-null, skip that many bytes of the content (or
+ * none, if the offset is not valid) and append the offset actually
+ * used to the header line.  If body is non-null, the content goes
+ * there instead of following the header on out. */
 static bool
 send_content(hash_lookup &hashdb, tag_lookup &tagdb, const string &hash,
-	     const string &prefix, ostream &out)
+	     const string &prefix, ostream &out, i64 *offsetp = nullptr,
+	     ostream *body = nullptr)
 {
   streambuf *sb;
   if (hashdb.lookup(hash) && (sb = hashdb.content())
       && tagdb.lookup(hashdb.info().message_id)) {
-    out << prefix << hashdb.info()
-	<< ' ' << tagdb.info() << '\n' << sb;
+    i64 offset = 0;
+    if (offsetp) {
+      offset = *offsetp;
+      if (offset < 0 || offset > hashdb.info().size
+	  || sb->pubseekpos(offset, ios_base::in) != offset)
+	offset = *offsetp = 0;
+    }
+    out << prefix << hashdb.info() << ' ' << tagdb.info();
+    if (offsetp)
+      out << ' ' << offset;
+    out << '\n';
+    if (offset < hashdb.info().size)
+      (body ? *body : out) << sb;
     return true;
   }
   return false;
 }
 
+server_state::server_state (sqlite3 *d, notmuch_db &n)
+  : db(d), nm(n), msync(new msg_sync(n, d))
+{
+}
+
+server_state::~server_state()
+{
+}
+
 void
-muchsync_server(sqlite3 *db, notmuch_db &nm)
+server_state::scan (bool force)
 {
-  msg_sync msync(nm, db);
+  i64 fp = xapian_fingerprint(nm.maildir);
+  if (fp == scanned && !force)
+    return;
+  nm.close();
+  sync_local_data(db, nm.maildir);
+  msync->refresh();
+  scanned = fp;
+  changed.notify_all();
+}
+
+/* What the server waits for in watch:  input from the client, or a
+ * scan that finds Xapian changed since seen.  With --daemon, the
+ * daemon's own scans move st.scanned; otherwise a thread of ours
+ * scans while we wait.  Another thread peeks at in, without reading
+ * anything, and only returns once the client sends more (or goes
+ * away), so the destructor must not run until the client has had
+ * its answer. */
+class change_waiter {
+  server_state &st_;
+  bool input_ = false;
+  bool done_ = false;
+  thread peek_;
+  thread scan_;
+public:
+  change_waiter(server_state &st, istream &in) : st_(st) {
+    peek_ = thread ([this,&in]() {
+	in.rdbuf()->sgetc();
+	lock_guard<mutex> _lk (st_.lock);
+	input_ = true;
+	st_.changed.notify_all();
+      });
+    if (!st_.rescanning)
+      scan_ = thread ([this]() {
+	  unique_lock<mutex> lk (st_.lock);
+	  while (!done_) {
+	    st_.changed.wait_for(lk, watch_interval);
+	    try {
+	      if (!done_)
+		st_.scan();
+	    }
+	    catch (const exception &e) {
+	      cerr << e.what() << '\n';
+	    }
+	  }
+	});
+  }
+  change_waiter(const change_waiter &) = delete;
+  /** Must hold lock, as with held */
+  void wait(unique_lock<mutex> &held, i64 seen) {
+    st_.changed.wait(held, [this,seen]() {
+	return input_ || st_.scanned != seen;
+      });
+    done_ = true;
+    st_.changed.notify_all();
+  }
+  /** Must not hold lock */
+  ~change_waiter() {
+    if (scan_.joinable())
+      scan_.join();
+    peek_.join();
+  }
+};
+
+void
+muchsync_server(server_state &st, istream &in, ostream &out)
+{
+  /* The session holds st.lock while it uses the databases, and lets
+   * go of it only between sync rounds, so that with --daemon other
+   * sessions and the background scan can run meanwhile. */
+  unique_lock<mutex> held (st.lock);
+  sqlite3 *db = st.db;
+  notmuch_db &nm = st.nm;
+  msg_sync &msync = *st.msync;
   hash_lookup &hashdb = msync.hashdb;
   tag_lookup tagdb(db);
   bool remotevv_valid = false;
   versvector remotevv;
+  i64 xapian_seen = st.scanned;	// What vect will reflect
   bool transaction = false;
   auto xbegin = [&transaction,db]() {
     if (!transaction) {
@@ -684,32 +1154,133 @@ muchsync_server(sqlite3 *db, notmuch_db &nm)
       transaction = true;
     }
   };
-
-  cout << "200 " << dbvers << '\n';
+  /* A client that goes away without commit leaves nothing behind,
+   * and nothing queued in msync for the next session. */
+  cleanup _rollback ([&transaction,&msync,&nm,db]() {
+      msync.discard();
+      if (transaction) {
+	sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+	load_tag_names (db);
+	// Release the Xapian lock so notmuch new can run
+	try { nm.close(); } catch (const exception &) {}
+      }
+    });
+
+  /* Message content goes out on bout and recv bodies come in on bin,
+   * which are the bulk streams with mux and otherwise the same as out
+   * and in. */
+  unique_ptr<mux> mx;
+  ostream bout (out.rdbuf());
+  istream bin (in.rdbuf());
+  cleanup _fixbufs ([&in,&out](streambuf *ib, streambuf *ob) {
+      in.rdbuf(ib);
+      out.rdbuf(ob);
+    }, in.rdbuf(), out.rdbuf());
+
+  out << "200 " << dbvers << ' ' << server_extensions << '\n';
   string cmdline;
   istringstream cmdstream;
-  while (getline(cin, cmdline).good()) {
+  wire_codec in_codec, out_codec, bulk_codec;
+  // Records received with link, recv and tags
+  record_parser rp (&in_codec);
+  hash_info rhi;
+  tag_info rti;
+  set_wire_codec (out, &out_codec);
+  set_wire_codec (bout, &bulk_codec);
+  out_codec.local_dirs->load (db);
+  bulk_codec.local_dirs = out_codec.local_dirs;
+  in_codec.resolve_dir = [&msync](const string &dir) {
+    return msync.known_dir_docid (dir);
+  };
+  in_codec.resolve_epoch = msync.dir_epoch();
+  cleanup _nocodec ([&out]() { set_wire_codec (out, nullptr); });
+
+  /* With mux, send commands queue up here (hash, and offset or -1),
+   * and their content goes out only while no command is waiting, so
+   * that a slow network holds up the bulk stream but not the control
+   * stream. */
+  deque<pair<string,i64>> sends;
+  auto send_one = [&]() {
+    const string &hash = sends.front().first;
+    i64 offset = sends.front().second;
+    if (send_content(hashdb, tagdb, hash, "220-", bout,
+		     offset >= 0 ? &offset : nullptr))
+      bout << "220 " << hash << '\n';
+    else if (hashdb.ok())
+      bout << "420 cannot open file\n";
+    else
+      bout << "520 unknown hash\n";
+    sends.pop_front();
+  };
+  auto next_command = [&]() {
+    while (!sends.empty() && in.rdbuf()->in_avail() == 0) {
+      if (mx->queued(mux::bulk) > bulk_backlog)
+	mx->await(mux::control, mux::bulk, bulk_backlog);
+      else
+	send_one();
+    }
+    if (transaction || remotevv_valid)
+      return getline(in, cmdline).good();
+    out << flush;
+    held.unlock();
+    bool ok = getline(in, cmdline).good();
+    held.lock();
+    return ok;
+  };
+
+  while (next_command()) {
     cmdstream.clear();
     cmdstream.str(cmdline);
     string cmd;
     cmdstream >> cmd;
+    size_t args = cmdline.find(cmd) + cmd.size();
+    /* Consecutive tags commands get applied together, but anything
+     * else may need to see the result. */
+    if (cmd != "tags")
+      msync.flush();
+    /* Only reads of tags may overtake queued content. */
+    if (cmd != "send" && cmd != "tsync" && cmd != "tinfo" && cmd != "tinfos")
+      while (!sends.empty()) {
+	mx->throttle(mux::bulk, bulk_backlog);
+	send_one();
+      }
     if (cmd.empty()) {
-      cout << "500 invalid empty line\n";
+      out << "500 invalid empty line\n";
     }
     else if (cmd == "quit") {
-      cout << "200 goodbye\n";
+      out << "200 goodbye\n";
       return;
     }
+    else if (cmd == "mux") {
+      if (mx)
+	out << "500 already multiplexed\n";
+      else {
+	mx.reset(new mux(in.rdbuf(), out.rdbuf()));
+	in.rdbuf(mx->in(mux::control));
+	out.rdbuf(mx->out(mux::control));
+	bout.rdbuf(mx->out(mux::bulk));
+	bin.rdbuf(mx->in(mux::bulk));
+	out << "200 mux\n";
+      }
+    }
+    else if (cmd == "tagdict") {
+      out_codec.tags = bulk_codec.tags = true;
+      out << "200 tagdict\n";
+    }
+    else if (cmd == "dirdict") {
+      out_codec.dirs = bulk_codec.dirs = true;
+      out << "200 dirdict\n";
+    }
     else if (cmd == "conffile") {
       ifstream is (opt_notmuch_config);
       ostringstream os;
       if (is.is_open() && (os << is.rdbuf())) {
 	string conf (os.str());
-	cout << "221-" << conf.length() << '\n'
+	out << "221-" << conf.length() << '\n'
 	     << conf << "221 ok\n";
       }
       else
-	cout << "410 cannot find configuration\n";
+	out << "410 cannot find configuration\n";
     }
     else if (cmd.substr(1) == "info") {
       string key;
@@ -717,133 +1288,282 @@ muchsync_server(sqlite3 *db, notmuch_db &nm)
       switch (cmd[0]) {
       case 'l':			// linfo command
 	if (hashdb.lookup(key))
-	  cout << "210 " << hashdb.info() << '\n';
+	  out << "210 " << hashdb.info() << '\n';
 	else
-	  cout << "510 unknown hash\n";
+	  out << "510 unknown hash\n";
 	break;
       case 't':			// tinfo command
 	if (tagdb.lookup(percent_decode(key)))
-	  cout << "210 " << tagdb.info() << '\n';
+	  out << "210 " << tagdb.info() << '\n';
 	else
-	  cout << "510 unkown message id\n";
+	  out << "510 unkown message id\n";
 	break;
       default:
-	cout << "500 unknown verb " << cmd << '\n';
+	out << "500 unknown verb " << cmd << '\n';
 	break;
       }
     }
+    else if (cmd == "tinfos") {
+      /* Followed by n percent-encoded message IDs, one per line.
+       * Answers with the tag_info of each one we know, in any order. */
+      i64 n = -1;
+      cmdstream >> n;
+      sqlexec (db, R"(
+CREATE TEMP TABLE IF NOT EXISTS tinfo_ids (
+  message_id TEXT PRIMARY KEY,
+  msgid_fp INTEGER);
+DELETE FROM tinfo_ids;)");
+      sqlstmt_t add (db, "INSERT OR IGNORE INTO tinfo_ids VALUES (?, ?);");
+      string id;
+      for (i64 i = 0; i < n && getline (in, id); i++) {
+	id = percent_decode(id);
+	add.reset().param(id, msgid_fp(id)).step();
+      }
+      if (n < 0)
+	out << "500 missing count\n";
+      else {
+	flush_journal (db);
+	sqlstmt_t found (db, R"(
+SELECT j.record
+FROM tinfo_ids w CROSS JOIN message_ids m
+       ON m.msgid_fp = w.msgid_fp AND m.message_id = w.message_id
+     CROSS JOIN change_journal j ON j.kind = 'T' AND j.id = m.docid;)");
+	while (found.step().row())
+	  out << "210-" << found.c_str(0) << '\n';
+	out << "210 ok\n";
+      }
+    }
     else if (cmd == "send") {
       string hash;
+      i64 offset;
       cmdstream >> hash;
-      if (send_content(hashdb, tagdb, hash, "220-", cout))
-	cout << "220 " << hash << '\n';
-      else if (hashdb.ok())
-	cout << "420 cannot open file\n";
-      else
-	cout << "520 unknown hash\n";
+      if (!(cmdstream >> offset))
+	offset = -1;
+      else if (offset < 0)
+	offset = 0;
+      sends.emplace_back(hash, offset);
+      if (!mx)
+	send_one();
+    }
+    else if (cmd == "scan") {
+      if (transaction)
+	out << "500 cannot scan before commit\n";
+      else {
+	st.scan();
+	xapian_seen = st.scanned;
+	out << "200 ok\n";
+      }
+    }
+    else if (cmd == "watch") {
+      out << flush;
+      {
+	change_waiter w (st, in);
+	w.wait(held, xapian_seen);
+	out << "200 ok\n" << flush;
+	held.unlock();
+      }
+      held.lock();
     }
     else if (cmd == "vect") {
       if (!read_sync_vector(cmdstream, remotevv)) {
-	cout << "500 could not parse vector\n";
+	out << "500 could not parse vector\n";
 	remotevv_valid = false;
       }
       else {
 	set_peer_vector(db, remotevv);
 	remotevv_valid = true;
-	cout << "200 " << show_sync_vector (get_sync_vector (db)) << '\n';
+	out << "200 " << show_sync_vector (get_sync_vector (db)) << '\n';
       }
     }
     else if (cmd == "link") {
       xbegin();
-      hash_info hi;
       if (!remotevv_valid)
-	cout << "500 must follow vect command\n";
-      else if (!(cmdstream >> hi))
-	cout << "500 could not parse hash_info\n";
-      else if (msync.hash_sync(remotevv, hi, nullptr, nullptr)) {
+	out << "500 must follow vect command\n";
+      else if (!rp.reset(cmdline, args).parse(rhi))
+	out << "500 could not parse hash_info\n";
+      else if (msync.hash_sync(remotevv, rhi, nullptr, nullptr)) {
 	if (opt_verbose > 3)
-	  cerr << "received-links " << hi << '\n';
-	cout << "220 " << hi.hash << " ok\n";
+	  cerr << "received-links " << rhi << '\n';
+	out << "220 " << rhi.hash << " ok\n";
       }
       else
-	cout << "520 " << hi.hash << " missing content\n";
+	out << "520 " << rhi.hash << " missing content\n";
     }
     else if (cmd == "recv") {
       xbegin();
-      hash_info hi;
-      tag_info ti;
       if (!remotevv_valid)
-	cout << "500 must follow vect command\n";
-      else if (!(cmdstream >> hi >> ti))
-	cout << "500 could not parse hash_info or tag_info\n";
+	out << "500 must follow vect command\n";
+      else if (!rp.reset(cmdline, args).parse(rhi) || !rp.parse(rti))
+	out << "500 could not parse hash_info or tag_info\n";
       else {
 	string path;
 	try {
-	  path = receive_message(cin, hi, nm.maildir);
-	  if (!msync.hash_sync(remotevv, hi, &path, &ti))
-	    cout << "550 failed to synchronize message\n";
+	  path = receive_message(bin, rhi, nm.maildir);
+	  if (!msync.hash_sync(remotevv, rhi, &path, &rti))
+	    out << "550 failed to synchronize message\n";
 	  else {
 	    if (opt_verbose > 3)
-	      cerr << "received-file " << hi << '\n';
-	    cout << "250 ok\n";
+	      cerr << "received-file " << rhi << '\n';
+	    out << "250 ok\n";
 	  }
 	}
 	catch (exception e) {
 	  cerr << e.what() << '\n';
-	  cout << "550 " << e.what() << '\n';
+	  out << "550 " << e.what() << '\n';
 	}
 	unlink(path.c_str());
       }
     }
     else if (cmd == "tags") {
       xbegin();
-      tag_info ti;
       if (!remotevv_valid)
-	cout << "500 must follow vect command\n";
-      else if (!(cmdstream >> ti))
-	cout << "500 could not parse hash_info\n";
-      else if (msync.tag_sync(remotevv, ti)) {
-	if (opt_verbose > 3)
-	  cerr << "received-tags " << ti << '\n';
-	cout << "220 ok\n";
+	out << "500 must follow vect command\n";
+      else if (!rp.reset(cmdline, args).parse(rti))
+	out << "500 could not parse hash_info\n";
+      else {
+	if (msync.tag_sync(remotevv, rti)) {
+	  if (opt_verbose > 3)
+	    cerr << "received-tags " << rti << '\n';
+	  out << "220 ok\n";
+	}
+	else
+	  out << "520 unknown message-id\n";
       }
-      else
-	cout << "520 unknown message-id\n";
     }
     else if (cmd.substr(1) == "sync") {
       if (!remotevv_valid)
-	cout << "500 must follow vect command\n";
+	out << "500 must follow vect command\n";
       else
 	switch (cmd[0]) {
 	case 'l':			// lsync command
-	  send_links (db, "210-", cout);
-	  cout << "210 ok\n";
+	  /* "lsync iblt" asks to reconcile first, if there is any point */
+	  {
+	    string arg;
+	    if (cmdstream >> arg && arg == "iblt"
+		&& first_sync (get_sync_vector (db), remotevv)) {
+	      out << "230 " << count_links (db) << '\n';
+	      break;
+	    }
+	  }
+	  send_links (db, "210-", out);
+	  out << "210 ok\n";
 	  break;
 	case 't':			// tsync command
-	  send_tags (db, "210-", cout);
-	  cout << "210 ok\n";
+	  send_tags (db, "210-", out);
+	  out << "210 ok\n";
 	  break;
 	default:
-	  cout << "500 unknown verb " << cmd << '\n';
+	  out << "500 unknown verb " << cmd << '\n';
 	  break;
 	}
     }
+    else if (cmd == "image") {
+      /* Snapshot the whole replica, then send every file in inode
+       * order, which is roughly the order they sit on disk. */
+      string vv;
+      vector<string> links, tags;
+      vector<pair<hash_info,string>> files;
+      sqlexec (db, "SAVEPOINT image;");
+      {
+	cleanup _release (sqlexec, db, "RELEASE image;");
+	flush_journal (db);
+	vv = show_sync_vector (get_sync_vector (db));
+	// fetch_image reads links in the plain form
+	wire_codec journal = journal_codec (db);
+	sqlstmt_t s (db, "SELECT kind, record FROM change_journal;");
+	while (s.step().row())
+	  if (*s.c_str(0) == 'L') {
+	    ostringstream os;
+	    put_journal_link (os, s.str(1), journal);
+	    links.push_back(os.str());
+	  }
+	  else
+	    tags.push_back(s.str(1));
+	sqlstmt_t f (db, R"(
+SELECT hash, size, dir_path, name
+FROM xapian_files JOIN xapian_dirs USING (dir_docid)
+     JOIN maildir_hashes USING (hash_id)
+ORDER BY inode;)");
+	while (f.step().row()) {
+	  hash_info hi;
+	  hi.hash = hash_from_key (f.str(0));
+	  hi.size = f.integer(1);
+	  string dir = f.str(2);
+	  files.emplace_back(hi, dir.empty() ? f.str(3) : dir + "/" + f.str(3));
+	}
+      }
+      out << "230-" << vv << '\n';
+      for (const string &r : links)
+	out << "232-" << r << '\n';
+      for (const string &r : tags)
+	out << "233-" << r << '\n';
+      i64 sent = 0;
+      for (const auto &f : files) {
+	ifstream is (nm.maildir + "/" + f.second);
+	ostringstream content;
+	// Skip files that went away or changed since the snapshot
+	if (!is.is_open() || !(content << is.rdbuf())
+	    || i64(content.str().size()) != f.first.size)
+	  continue;
+	out << "231-" << f.first.hash << ' ' << f.first.size << ' '
+	    << permissive_percent_encode(f.second) << '\n' << content.str();
+	sent++;
+      }
+      out << "230 " << sent << '\n';
+    }
+    else if (cmd == "iblt") {
+      /* Reply with the digests of the links only the client has, then
+       * proceed as lsync but send only the links the client lacks. */
+      iblt theirs;
+      vector<uint64_t> ours_only, theirs_only;
+      if (!remotevv_valid)
+	out << "500 must follow vect command\n";
+      else if (!(cmdstream >> theirs) || theirs.size() == 0)
+	out << "500 could not parse iblt\n";
+      else {
+	iblt diff = link_iblt (db, theirs.size());
+	diff -= theirs;
+	if (!diff.decode (&ours_only, &theirs_only))
+	  out << "520 too many differences\n";
+	else {
+	  for (uint64_t d : theirs_only)
+	    out << "220-" << hex << d << dec << '\n';
+	  out << "220 " << theirs_only.size() << '\n';
+	  unordered_set<string> only = digest_hashes
+	    (db, unordered_set<uint64_t> (ours_only.begin(), ours_only.end()));
+	  send_links (db, "210-", out, &only);
+	  out << "210 ok\n";
+	}
+      }
+    }
     else if (cmd == "commit") {
       if (!remotevv_valid)
-	cout << "500 must follow vect command\n";
+	out << "500 must follow vect command\n";
+      nm.close();
       record_peer_vector(db);
       if (transaction) {
 	transaction = false;
 	sqlexec(db, "COMMIT;");
       }
-      cout << "200 ok\n";
+      out << "200 ok\n";
       remotevv_valid = false;
     }
     else
-      cout << "500 unknown verb " << cmd << '\n';
+      out << "500 unknown verb " << cmd << '\n';
   }
 }
 
+static unordered_set<string>
+greeting_extensions (const string &greeting)
+{
+  istringstream is (greeting.substr(4));
+  unordered_set<string> ret;
+  string word;
+  while (is >> word)
+    ret.insert(word);
+  return ret;
+}
+
 istream &
 get_response (istream &in, string &line, bool err_ok)
 {
@@ -860,11 +1580,270 @@ get_response (istream &in, string &line, bool err_ok)
   return in;
 }
 
+/* Decides when the client commits in the middle of a long
+ * synchronization.  Committing closes the notmuch database, since
+ * that is the only way notmuch offers to make Xapian durable, and the
+ * next change pays for reopening it and refilling its caches.  So
+ * commit only once enough work is pending that losing it would hurt,
+ * once the oldest uncommitted change has waited long enough, or once
+ * the transaction has grown SQLite's write-ahead log far enough that
+ * reads slow down and the next checkpoint has a lot to copy.  The log
+ * is reused from the start after a checkpoint, so its growth since the
+ * last commit is a lower bound on what the transaction has written. */
+class commit_policy {
+  static constexpr i64 max_changes = 20000;
+  static constexpr i64 max_bytes = 0x10000000;
+  static constexpr time_t max_latency = 60;
+  static constexpr i64 max_wal_growth = 0x4000000;
+  static constexpr i64 wal_check_interval = 256;	// Changes
+  const string wal_path_;
+  i64 changes_ = 0;
+  i64 bytes_ = 0;
+  time_t oldest_ = 0;
+  i64 wal_checked_ = 0;
+  i64 wal_base_ = 0;
+  i64 wal_size() const {
+    struct stat sb;
+    return stat(wal_path_.c_str(), &sb) ? 0 : sb.st_size;
+  }
+  bool wal_grown() {
+    if (changes_ - wal_checked_ < wal_check_interval)
+      return false;
+    wal_checked_ = changes_;
+    return wal_size() - wal_base_ >= max_wal_growth;
+  }
+public:
+  explicit commit_policy(sqlite3 *db)
+    : wal_path_(string(sqlite3_db_filename(db, "main")) + "-wal") {
+    reset();
+  }
+  /** Count one message or link set changed, and bytes received. */
+  void add(i64 bytes) {
+    if (!changes_)
+      oldest_ = time(nullptr);
+    changes_++;
+    bytes_ += bytes;
+  }
+  bool due() {
+    return changes_ >= max_changes || bytes_ >= max_bytes
+      || (changes_ && time(nullptr) - oldest_ >= max_latency)
+      || wal_grown();
+  }
+  void reset() {
+    changes_ = bytes_ = wal_checked_ = 0;
+    wal_base_ = wal_size();
+  }
+};
+
+/* Answer the server's "230 <count>" response to "lsync iblt", where
+ * count is the number of links the server has.  If the two sets of
+ * links are close enough in size, send an iblt of ours and collect
+ * in only the hashes of the links only we have, before anything from
+ * the server changes them, else ask for a plain lsync.  Either way,
+ * leaves the first line of the server's lsync output in line.
+ * Returns true if the sets were reconciled. */
+static bool
+reconcile_links (sqlite3 *db, istream &in, ostream &out, string &line,
+		 unordered_set<string> &only)
+{
+  constexpr i64 min_cells = 1536;
+  i64 theirs = stoll(line.substr(4));
+  i64 ours = count_links (db);
+  i64 ncells = max(min_cells, 4 * (theirs > ours ? theirs - ours
+				   : ours - theirs));
+  if (ncells > max(theirs, ours) / 2) {
+    out << "lsync\n" << flush;
+    get_response (in, line);
+    return false;
+  }
+  out << "iblt " << link_iblt (db, ncells) << '\n' << flush;
+  get_response (in, line, true);
+  if (line.at(0) == '5') {
+    if (opt_verbose)
+      cerr << "reconciliation failed: " << line.substr(4) << '\n';
+    out << "lsync\n" << flush;
+    get_response (in, line);
+    return false;
+  }
+  unordered_set<uint64_t> digests;
+  for (; line.at(3) == '-'; get_response (in, line))
+    digests.insert(stoull(line.substr(4), nullptr, 16));
+  only = digest_hashes (db, digests);
+  get_response (in, line);
+  print_time ("reconciled links with server");
+  return true;
+}
+
+bool
+fetch_image (istream &in, ostream &out, const string &greeting,
+	     const string &maildir, replica_image &img)
+{
+  if (!greeting_extensions(greeting).count("image"))
+    return false;
+  out << "image\n" << flush;
+  string line;
+  istringstream is;
+  get_response (in, line);
+  is.str(line.substr(4));
+  if (line.compare(0, 4, "230-") || !read_sync_vector(is, img.vv))
+    throw runtime_error ("bad image header: " + line);
+
+  i64 nfiles = 0;
+  for (get_response (in, line); line.at(3) == '-'; get_response (in, line)) {
+    is.clear();
+    is.str(line.substr(4));
+    if (line.compare(0, 3, "232") == 0) {
+      img.links.emplace_back();
+      if (!(is >> img.links.back()))
+	throw runtime_error ("could not parse hash_info: " + line.substr(4));
+      continue;
+    }
+    if (line.compare(0, 3, "233") == 0) {
+      img.tags.push_back (line.substr(4));
+      continue;
+    }
+    hash_info hi;
+    string rel;
+    if (!(is >> hi.hash >> hi.size >> rel) || !hash_ok(hi.hash))
+      throw runtime_error ("bad image file header: " + line);
+    rel = percent_decode (rel);
+    if (rel.empty() || rel.front() == '/' || !sanity_check_path(rel))
+      throw runtime_error ("illegal path in image: " + rel);
+    string tmp;
+    try {
+      tmp = receive_message (in, hi, maildir);
+    }
+    catch (const runtime_error &e) {
+      // Changed on the server while we were receiving it
+      if (!in)
+	throw;
+      cerr << rel << ": " << e.what() << '\n';
+      continue;
+    }
+    cleanup _unlink (unlink, tmp.c_str());
+    string target = maildir + "/" + rel;
+    size_t slash = target.rfind('/');
+    if (!maildir_mkdir (target.substr(0, slash)))
+      throw runtime_error ("cannot create directory for " + rel);
+    if (link (tmp.c_str(), target.c_str()) && errno != EEXIST)
+      throw runtime_error (target + ": " + strerror(errno));
+    if (opt_verbose > 2)
+      cerr << "image " << rel << '\n';
+    nfiles++;
+  }
+  if (opt_verbose)
+    cerr << "received " << nfiles << " files in image\n";
+  print_time ("received replica image");
+  return true;
+}
+
+void
+apply_image (sqlite3 *db, notmuch_db &nm, const replica_image &img)
+{
+  load_tag_names (db);
+  vector<tag_info> img_tags (img.tags.size());
+  record_parser rp;
+  for (size_t i = 0; i < img_tags.size(); i++)
+    if (!rp.reset(img.tags[i]).parse(img_tags[i]))
+      throw runtime_error ("could not parse tag_info: " + img.tags[i]);
+
+  constexpr size_t batch = 4096;
+  for (size_t i = 0; i < img_tags.size(); i += batch) {
+    nm.begin_atomic();
+    for (size_t j = i; j < img_tags.size() && j < i + batch; j++)
+      if (notmuch_db::message_t msg =
+	  nm.get_message (img_tags[j].message_id.c_str())) {
+	notmuch_db::tags_t tags (img_tags[j].tags.names(db));
+	tags.erase("");		// Placeholder for an untagged message
+	nm.set_tags (msg, tags);
+      }
+    nm.end_atomic();
+  }
+  nm.close();
+  print_time ("applied tags from image");
+  sync_local_data (db, nm.maildir);
+
+  /* Where our links or tags came out the same as the server's, take
+   * over the server's writestamp.  If everything did, we have seen
+   * everything the server had, and can take over its version vector
+   * too, so the first synchronization only sends later changes. */
+  bool complete = true;
+  sqlexec (db, "BEGIN IMMEDIATE;");
+  cleanup _rollback ([db]() {
+      sqlite3_exec (db, "ROLLBACK;", nullptr, nullptr, nullptr);
+      load_tag_names (db);
+    });
+  hash_lookup hashdb (nm.maildir, db);
+  sqlstmt_t hash_stamp (db, "UPDATE maildir_hashes SET replica = ?,"
+			" version = ? WHERE hash_id = ?;");
+  for (const hash_info &hi : img.links) {
+    if (hashdb.lookup(hi.hash) && hashdb.info().dirs == hi.dirs)
+      hash_stamp.reset().param(hi.hash_stamp.first, hi.hash_stamp.second,
+			       hashdb.hash_id()).step();
+    else if (!hi.dirs.empty())
+      complete = false;
+  }
+  tag_lookup tagdb (db);
+  sqlstmt_t tag_stamp (db, "UPDATE message_ids SET replica = ?,"
+		       " version = ? WHERE docid = ?;");
+  for (const tag_info &ti : img_tags) {
+    if (!tagdb.lookup(ti.message_id))
+      continue;			// Deleted on the server
+    if (tagdb.info().tags == ti.tags)
+      tag_stamp.reset().param(ti.tag_stamp.first, ti.tag_stamp.second,
+			      tagdb.docid()).step();
+    else
+      complete = false;
+  }
+  if (complete) {
+    sqlstmt_t vv (db, "INSERT OR REPLACE INTO sync_vector (replica, version)"
+		  " VALUES (?, ?);");
+    for (writestamp ws : img.vv)
+      vv.reset().param(ws.first, ws.second).step();
+  }
+  _rollback.release();
+  sqlexec (db, "COMMIT;");
+  if (opt_verbose)
+    cerr << (complete ? "replica image applied in full\n"
+	     : "replica image differs from files received\n");
+  print_time ("applied replica image");
+}
+
+/* An extra connection to the server, used only to fetch message
+ * content (--channels).  The server at the other end neither runs
+ * notmuch new nor scans, since the main connection has just done so. */
+struct content_channel {
+  int fds[2];
+  ofdstream out;
+  ifdinfinistream in;
+  bool greeted = false;
+  content_channel() : out ((open_channel(fds), fds[1])), in (fds[0]) {
+    in.tie (&out);
+  }
+  ~content_channel() {
+    if (std::uncaught_exception())
+      return;
+    out << "quit\n" << flush;
+    string line;
+    while (getline (in, line))
+      ;
+  }
+  istream &input() {
+    if (!greeted) {
+      string line;
+      get_response (in, line);
+      greeted = true;
+    }
+    return in;
+  }
+};
+
 void
 muchsync_client (sqlite3 *db, notmuch_db &nm,
-		 istream &in, ostream &out)
+		 istream &in, ostream &out, const string &greeting)
 {
-  constexpr time_t commit_interval = 10;
+  /* For --continuous, the state of Xapian when we last scanned it */
+  i64 xapian_seen = opt_continuous ? xapian_fingerprint(nm.maildir) : 0;
   /* Any work done here gets overlapped with server */
   sync_local_data (db, nm.maildir);
   versvector localvv {get_sync_vector (db)}, remotevv;
@@ -876,172 +1855,470 @@ muchsync_client (sqlite3 *db, notmuch_db &nm,
   int down_links = 0, down_body = 0, down_tags = 0,
     up_links = 0, up_body = 0, up_tags = 0;
 
-  out << "vect " << show_sync_vector(localvv) << "\nlsync\n" << flush;
-  sqlexec(db, "BEGIN IMMEDIATE;");
-  get_response (in, line);
-  get_response (in, line);
-  is.str(line.substr(4));
-  if (!read_sync_vector(is, remotevv))
-    throw runtime_error ("cannot parse version vector " + line.substr(4));
-  set_peer_vector(db, remotevv);
-  print_time ("received server's version vector");
-
-  catch_interrupts(SIGINT, true);
-  catch_interrupts(SIGTERM, true);
-  time_t last_commit = time(nullptr);
-  auto maybe_commit = [&last_commit,&nm,db] () {
-    time_t now = time(nullptr);
-    if (interrupted) {
-      cerr << "Interrupted\n";
-      nm.close();
-      sqlexec(db, "COMMIT;");
-      exit(1);
-    }
-    else if (now - last_commit >= commit_interval) {
-      nm.close();
-      sqlexec(db, "COMMIT; BEGIN;");
-      last_commit = now;
-    }
+  /* The server sends its greeting once it has finished scanning,
+   * which the version vector has to wait for anyway, so waiting for
+   * the greeting to pick extensions costs next to nothing. */
+  if (greeting.empty())
+    get_response (in, line);
+  else
+    line = greeting;
+  unordered_set<string> extensions = greeting_extensions(line);
+  bool resume = extensions.count("resume");
+  bool reconcile = extensions.count("iblt");
+  bool bulk_tinfo = extensions.count("tinfos");
+  if (opt_continuous && !extensions.count("watch"))
+    throw runtime_error ("server does not support --continuous");
+  bool watch_pending = false;
+
+  /* Message content arrives on bin and leaves on bout, which are the
+   * bulk streams with mux and otherwise just other views of in and
+   * out. */
+  unique_ptr<mux> mx;
+  istream bin (in.rdbuf());
+  bin.tie (&out);
+  ostream bout (out.rdbuf());
+  cleanup _fixbufs ([&in,&out](streambuf *ib, streambuf *ob) {
+      in.rdbuf(ib);
+      out.rdbuf(ob);
+    }, in.rdbuf(), out.rdbuf());
+  if (extensions.count("mux")) {
+    out << "mux\n";
+    mx.reset(new mux(in.rdbuf(), out.rdbuf()));
+    in.rdbuf(mx->in(mux::control));
+    out.rdbuf(mx->out(mux::control));
+    bin.rdbuf(mx->in(mux::bulk));
+    bout.rdbuf(mx->out(mux::bulk));
+  }
+  /* Peer IDs learned from the server's responses, and those we have
+   * announced on out. */
+  bool tagdict = extensions.count("tagdict");
+  bool dirdict = extensions.count("dirdict");
+  wire_codec in_codec, out_codec;
+  set_wire_codec (is, &in_codec);
+  record_parser rp (&in_codec);
+  set_wire_codec (out, &out_codec);
+  out_codec.local_dirs->load (db);
+  in_codec.resolve_dir = [&msync](const string &dir) {
+    return msync.known_dir_docid (dir);
   };
+  in_codec.resolve_epoch = msync.dir_epoch();
+  cleanup _nocodec ([&out,&is]() {
+      set_wire_codec (out, nullptr);
+      set_wire_codec (is, nullptr);
+    });
+  if (tagdict) {
+    out << "tagdict\n";
+    out_codec.tags = true;
+  }
+  if (dirdict) {
+    out << "dirdict\n";
+    out_codec.dirs = true;
+  }
 
-  while (get_response (in, line) && line.at(3) == '-') {
+  /* Between --continuous rounds, a thread peeks at in for the answer
+   * to watch, without reading anything, and then writes a byte to
+   * wake, so that one poll waits for either replica to change.  It
+   * must be joined before anyone reads in, and on the way out, the
+   * server needs a quit to answer the watch and let it go. */
+  int xwatch = opt_continuous ? xapian_watch (nm.maildir) : -1;
+  int wake[2] = { -1, -1 };
+  if (opt_continuous && pipe (wake))
+    throw runtime_error (string ("pipe: ") + strerror (errno));
+  thread peek;
+  auto join_peek = [&peek,&wake]() {
+    if (peek.joinable()) {
+      peek.join();
+      char c;
+      read (wake[0], &c, 1);
+    }
+  };
+  cleanup _watch ([&]() {
+      if (peek.joinable()) {
+	out << "quit\n" << flush;
+	peek.join();
+      }
+      for (int fd : { xwatch, wake[0], wake[1] })
+	if (fd >= 0)
+	  close (fd);
+    });
+
+  for (bool first = true;; first = false) {
+    if (!first) {
+      i64 fp = xapian_fingerprint(nm.maildir);
+      out << "scan\n" << flush;
+      // Nothing to scan when only the server has changed
+      if (fp != xapian_seen) {
+	xapian_seen = fp;
+	sync_local_data (db, nm.maildir);
+	msync.refresh();
+      }
+      localvv = get_sync_vector (db);
+      pending = 0;
+      down_links = down_body = down_tags = up_links = up_body = up_tags = 0;
+    }
+    out << "vect " << show_sync_vector(localvv)
+	<< (reconcile ? "\nlsync iblt\n" : "\nlsync\n") << flush;
+    sqlexec(db, "BEGIN IMMEDIATE;");
+    /* On error, leave the dictionary and msync as the rollback left
+     * the database, for whoever handles the exception. */
+    cleanup _rollback ([&msync,db]() {
+	msync.discard();
+	sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+	load_tag_names (db);
+      });
+    if (first && mx)
+      get_response (in, line);
+    if (first && tagdict)
+      get_response (in, line);
+    if (first && dirdict)
+      get_response (in, line);
+    if (watch_pending) {
+      join_peek();
+      get_response (in, line);
+      watch_pending = false;
+    }
+    if (!first)
+      get_response (in, line);
+    get_response (in, line);
+    is.clear();
     is.str(line.substr(4));
+    if (!read_sync_vector(is, remotevv))
+      throw runtime_error ("cannot parse version vector " + line.substr(4));
+    set_peer_vector(db, remotevv);
+    // A first sync brings in the whole replica, so apply it in batches
+    msync.defer (first_sync (localvv, remotevv));
+    print_time ("received server's version vector");
+
+    /* Answer the server's responses to n link commands, sending the
+     * content of any message it is missing.  Returns the number of recv
+     * commands whose responses are still outstanding. */
+    auto send_missing = [&] (i64 n) -> i64 {
+      i64 sent = 0;
+      while (n-- > 0) {
+	getline(in, line);
+	if (line.size() < 4 || (line.at(0) != '2' && line.at(0) != '5'))
+	  throw runtime_error ("lost sync while receiving message: " + line);
+	if (line.at(0) == '5') {
+	  is.clear();
+	  is.str(line.substr(4));
+	  string hash;
+	  is >> hash;
+	  if (send_content(msync.hashdb, msync.tagdb, hash, "recv ", out,
+			   nullptr, &bout)) {
+	    sent++;
+	    up_body++;
+	    if (mx)
+	      mx->throttle(mux::bulk, bulk_backlog);
+	  }
+	}
+	else
+	  up_links++;
+      }
+      return sent;
+    };
+
+    /* With --overlap, the upload is queued right behind lsync, so the
+     * server applies our changes and we push new messages while its own
+     * changes are still coming down.  Conflicts resolve the same as in
+     * the sequential order:  each side merges the other's state from
+     * before the sync, and the merge is symmetric. */
+    bool overlap = opt_overlap && !opt_noup && !opt_upbg
+      && !(reconcile && first_sync (localvv, remotevv));
+    i64 up_sent_links = 0;
+    if (overlap) {
+      up_sent_links = send_links(db, "link ", out);
+      up_tags = send_tags(db, "tags ", out);
+      out << flush;
+      print_time("queued local changes for server");
+    }
+
+    catch_interrupts(SIGINT, true);
+    catch_interrupts(SIGTERM, true);
+    commit_policy work (db);
+    /* notmuch commits its changes at the end of the outermost atomic
+     * section, so one section spans each of our transactions, and the
+     * Xapian database stays open between them. */
+    nm.begin_atomic();
+    cleanup _atomic ([&nm]() {
+	try { nm.end_atomic(); } catch (const exception &) {}
+      });
+    auto maybe_commit = [&work,&nm,&msync,db] (i64 nbytes) {
+      work.add(nbytes);
+      if (interrupted) {
+	cerr << "Interrupted\n";
+	msync.flush();
+	nm.end_atomic();
+	nm.close();
+	sqlexec(db, "COMMIT;");
+	exit(1);
+      }
+      else if (work.due()) {
+	msync.flush();
+	nm.end_atomic();
+	sqlexec(db, "COMMIT; BEGIN;");
+	nm.begin_atomic();
+	work.reset();
+      }
+    };
+
+    /* Each missing message is requested over whichever connection has
+     * the fewest bytes queued, and the bodies are read back in the same
+     * order they were requested. */
+    vector<unique_ptr<content_channel>> channels (opt_channels - 1);
+    vector<i64> queued (opt_channels);
+    vector<int> body_channel;
+
+    /* On a first sync, the server may offer to reconcile our links
+     * with its own, so that neither side sends the links the other
+     * already has. */
+    unordered_set<string> upload_only;
+    bool reconciled = false;
+    get_response (in, line);
+    if (line.compare(0, 4, "230 ") == 0)
+      reconciled = reconcile_links (db, in, out, line, upload_only);
+
     hash_info hi;
-    if (!(is >> hi))
-      throw runtime_error ("could not parse hash_info: " + line.substr(4));
-    bool ok = msync.hash_sync (remotevv, hi, nullptr, nullptr);
-    if (opt_verbose > 2) {
-      if (ok)
-	cerr << hi << '\n';
+    tag_info ti;
+    for (; line.at(3) == '-'; get_response (in, line)) {
+      if (!rp.reset(line, 4).parse(hi))
+	throw runtime_error ("could not parse hash_info: " + line.substr(4));
+      bool ok = msync.hash_sync (remotevv, hi, nullptr, nullptr);
+      if (opt_verbose > 2) {
+	if (ok)
+	  cerr << hi << '\n';
+	else
+	  cerr << hi.hash << " UNKNOWN\n";
+      }
+      if (!ok) {
+	int c = min_element(queued.begin(), queued.end()) - queued.begin();
+	queued[c] += hi.size;
+	body_channel.push_back(c);
+	if (c && !channels[c-1])
+	  channels[c-1].reset(new content_channel);
+	ostream &o = c ? channels[c-1]->out : out;
+	o << "send " << hi.hash;
+	if (resume)
+	  o << ' ' << partial_length(nm.maildir, hi);
+	o << '\n';
+	if (c)
+	  o << flush;
+      }
       else
-	cerr << hi.hash << " UNKNOWN\n";
+	down_links++;
+      maybe_commit(0);
     }
-    if (!ok) {
-      out << "send " << hi.hash << '\n';
-      pending++;
+    msync.flush_index();
+    out << "tsync\n";
+    /* Ask for the tags of messages we have files for but no tags,
+     * e.g., after undeleting them. */
+    vector<string> orphans;
+    for (sqlstmt_t nolinks (db, "SELECT message_id FROM message_ids"
+			    " WHERE replica = 0 AND version = 0;");
+	 nolinks.step().row();)
+      orphans.push_back(permissive_percent_encode(nolinks.str(0)));
+    int extra_tags = 0;
+    if (bulk_tinfo && !orphans.empty()) {
+      out << "tinfos " << orphans.size() << '\n';
+      for (const string &id : orphans)
+	out << id << '\n';
     }
     else
-      down_links++;
-    maybe_commit();
-  }
-  out << "tsync\n";
-  int extra_tags = 0;
-  for (sqlstmt_t nolinks (db, "SELECT message_id FROM message_ids"
-			  " WHERE replica = 0 AND version = 0;");
-       nolinks.step().row();) {
-    extra_tags++;
-    out << "tinfo " << permissive_percent_encode(nolinks.str(0)) << '\n';
-  }
-  print_time ("received hashes of new files");
-  down_body = pending;
-
-  hash_info hi;
-  tag_info ti;
-  for (; pending > 0; pending--) {
-    get_response (in, line);
-    is.str(line.substr(4));
-    if (!(is >> hi >> ti))
-      throw runtime_error ("could not parse hash_info: " + line.substr(4));
-    string path = receive_message(in, hi, nm.maildir);
-    cleanup _unlink (unlink, path.c_str());
-    getline (in, line);
-    if (line.size() < 4 || line.at(0) != '2' || line.at(3) != ' '
-	|| line.substr(4) != hi.hash)
-      throw runtime_error ("lost sync while receiving message: " + line);
-    if (!msync.hash_sync (remotevv, hi, &path, &ti))
-      throw runtime_error ("msg_sync::sync failed even with source");
-    if (opt_verbose > 2)
-      cerr << hi << '\n';
-    maybe_commit();
-  }
-  print_time ("received content of missing messages");
+      for (const string &id : orphans) {
+	extra_tags++;
+	out << "tinfo " << id << '\n';
+      }
+    print_time ("received hashes of new files");
+
+    i64 up_pending = 0;
+    if (overlap) {
+      up_pending = send_missing(up_sent_links);
+      for (i64 i = 0; i < up_tags; i++)
+	get_response(in, line);
+      print_time("sent content of new messages to server");
+    }
+    down_body = body_channel.size();
+
+    /* body_channel grows when a resume fails and the message is asked
+     * for again from the start.  Without mux, a second request on in
+     * would be answered only after tsync, so such requests go over one
+     * extra channel, opened for the first of them.  Each channel
+     * answers in the order asked, as body_channel reads them. */
+    int retry_channel = 0;
+    for (size_t b = 0; b < body_channel.size(); b++) {
+      int c = body_channel[b];
+      istream &src = c ? channels[c-1]->input() : bin;
+      get_response (src, line);
+      i64 offset = 0;
+      if (!rp.reset(line, 4).parse(hi) || !rp.parse(ti)
+	  || (resume && !rp.parse(offset)))
+	throw runtime_error ("could not parse hash_info: " + line.substr(4));
+      string path = receive_message(src, hi, nm.maildir, resume, offset);
+      getline (src, line);
+      if (line.size() < 4 || line.at(0) != '2' || line.at(3) != ' '
+	  || line.substr(4) != hi.hash)
+	throw runtime_error ("lost sync while receiving message: " + line);
+      if (path.empty()) {
+	if (opt_verbose)
+	  cerr << hi.hash << ": cannot resume, fetching it again\n";
+	if (!c && !mx) {
+	  if (!retry_channel) {
+	    channels.emplace_back(new content_channel);
+	    retry_channel = channels.size();
+	  }
+	  c = retry_channel;
+	}
+	ostream &o = c ? channels[c-1]->out : out;
+	o << "send " << hi.hash << " 0\n" << flush;
+	body_channel.push_back(c);
+	continue;
+      }
+      cleanup _unlink (unlink, path.c_str());
+      if (!msync.hash_sync (remotevv, hi, &path, &ti))
+	throw runtime_error ("msg_sync::sync failed even with source");
+      if (opt_verbose > 2)
+	cerr << hi << '\n';
+      maybe_commit(hi.size);
+    }
+    channels.clear();
+    if (resume)
+      clean_partials(nm.maildir);
+    msync.flush_index();
+    print_time ("received content of missing messages");
+
+    while (get_response (in, line) && line.at(3) == '-') {
+      down_tags++;
+      if (!rp.reset(line, 4).parse(ti))
+	throw runtime_error ("could not parse tag_info: " + line.substr(4));
+      if (opt_verbose > 2)
+	cerr << ti << '\n';
+      msync.tag_sync(remotevv, ti);
+      maybe_commit(0);
+    }
+    if (bulk_tinfo && !orphans.empty())
+      while (get_response (in, line) && line.at(3) == '-') {
+	if (!rp.reset(line, 4).parse(ti))
+	  throw runtime_error ("could not parse tag_info: " + line.substr(4));
+	down_tags++;
+	if (opt_verbose > 2)
+	  cerr << ti << '\n';
+	msync.tag_sync(remotevv, ti);
+	maybe_commit(0);
+      }
+    for (; extra_tags > 0; extra_tags--) {
+      get_response(in, line, true);
+      if (line[0] == '5')
+	continue;
+      if (!rp.reset(line, 4).parse(ti))
+	throw runtime_error ("could not parse tag_info: " + line.substr(4));
+      down_tags++;
+      if (opt_verbose > 2)
+	cerr << ti << '\n';
+      msync.tag_sync(remotevv, ti);
+      maybe_commit(0);
+    }
+    msync.flush();
+    print_time ("received tags of new and modified messages");
+
+    record_peer_vector(db);
+
+    _atomic.release();
+    nm.end_atomic();
+    nm.close();
+    sqlexec (db, "COMMIT;");
+    _rollback.release();
+    print_time("commited changes to local database");
+
+    if (opt_verbose || opt_noup || opt_upbg)
+      cerr << "received " << down_body << " messages, "
+	   << down_links << " link changes, "
+	   << down_tags << " tag changes\n";
+    catch_interrupts(SIGINT, false);
+    catch_interrupts(SIGTERM, false);
+
+    if (opt_noup)
+      return;
+    if (opt_upbg)
+      close(opt_upbg_fd);
 
-  while (get_response (in, line) && line.at(3) == '-') {
-    down_tags++;
-    is.str(line.substr(4));
-    if (!(is >> ti))
-      throw runtime_error ("could not parse tag_info: " + line.substr(4));
-    if (opt_verbose > 2)
-      cerr << ti << '\n';
-    msync.tag_sync(remotevv, ti);
-    maybe_commit();
-  }
-  for (; extra_tags > 0; extra_tags--) {
-    get_response(in, line, true);
-    if (line[0] == '5')
-      continue;
-    is.str(line.substr(4));
-    if (!(is >> ti))
-      throw runtime_error ("could not parse tag_info: " + line.substr(4));
-    down_tags++;
-    if (opt_verbose > 2)
-      cerr << ti << '\n';
-    msync.tag_sync(remotevv, ti);
-    maybe_commit();
-  }
-  print_time ("received tags of new and modified messages");
+    if (overlap)
+      pending = up_pending;
+    else {
+      i64 i = send_links(db, "link ", out,
+			 reconciled ? &upload_only : nullptr);
+      print_time("sent moved messages to server");
+      pending = send_missing(i);
+      print_time("sent content of new messages to server");
+      up_tags = send_tags(db, "tags ", out);
+      pending += up_tags;
+      print_time("sent modified tags to server");
+    }
+    out << "commit\n";
 
-  record_peer_vector(db);
+    if (opt_verbose)
+      cerr << "sent " << up_body << " messages, "
+	   << up_links << " link changes, "
+	   << up_tags << " tag changes\n";
 
-  nm.close();
-  sqlexec (db, "COMMIT;");
-  print_time("commited changes to local database");
+    while (pending-- > 0)
+      get_response(in, line);
+    get_response(in, line);
+    print_time("commit succeeded on server");
+
+    if ((!opt_upbg && !opt_continuous) || opt_verbose) {
+      int w = 5;
+      cerr << "SUMMARY:\n"
+	   << "  received " << setw(w) << down_body << " messages, "
+	   << setw(w) << down_links << " link changes, "
+	   << setw(w) << down_tags << " tag changes\n";
+      cerr << "      sent " << setw(w) << up_body << " messages, "
+	   << setw(w) << up_links << " link changes, "
+	   << setw(w) << up_tags << " tag changes\n";
+    }
 
-  if (opt_verbose || opt_noup || opt_upbg)
-    cerr << "received " << down_body << " messages, "
-	 << down_links << " link changes, "
-	 << down_tags << " tag changes\n";
-  catch_interrupts(SIGINT, false);
-  catch_interrupts(SIGTERM, false);
+    if (!opt_continuous)
+      break;
 
-  if (opt_noup)
-    return;
-  if (opt_upbg)
-    close(opt_upbg_fd);
-
-  pending = 0;
-  i64 i = send_links(db, "link ", out);
-  print_time("sent moved messages to server");
-  while (i-- > 0) {
-    getline(in, line);
-    if (line.size() < 4 || (line.at(0) != '2' && line.at(0) != '5'))
-      throw runtime_error ("lost sync while receiving message: " + line);
-    if (line.at(0) == '5') {
-      is.str(line.substr(4));
-      string hash;
-      is >> hash;
-      if (send_content(msync.hashdb, msync.tagdb, hash, "recv ", out)) {
-	pending++;
-	up_body++;
+    /* Leave a watch command with the server, which answers it once
+     * the server's notmuch database changes.  Meanwhile, wait for
+     * inotify to report writes to our own, and check the fingerprint
+     * only then, or without inotify, every watch_interval.  Our own
+     * commit and the server's usually trigger one more round, which
+     * then finds nothing to do. */
+    out << "watch\n" << flush;
+    watch_pending = true;
+    peek = thread ([&in,&wake]() {
+	in.rdbuf()->sgetc();
+	write (wake[1], "", 1);
+      });
+    catch_interrupts(SIGINT, true);
+    catch_interrupts(SIGTERM, true);
+    for (;;) {
+      if (interrupted)
+	return;
+      pollfd fds[] = { { wake[0], POLLIN, 0 }, { xwatch, POLLIN, 0 } };
+      // With inotify, wake up now and then only to notice interrupts
+      poll (fds, xwatch >= 0 ? 2 : 1,
+	    xwatch >= 0 ? 1000 : int (watch_interval.count()));
+      if (fds[0].revents) {
+	join_peek();
+	if (in.rdbuf()->in_avail() < 0) {
+	  if (opt_verbose)
+	    cerr << "server closed the connection\n";
+	  return;
+	}
+	get_response (in, line);
+	watch_pending = false;
+	break;
+      }
+      if (xwatch >= 0) {
+	if (!fds[1].revents)
+	  continue;
+	char buf[4096];
+	while (read (xwatch, buf, sizeof (buf)) > 0)
+	  ;
       }
+      if (xapian_fingerprint(nm.maildir) != xapian_seen)
+	break;
     }
-    else
-      up_links++;
-  }
-  print_time("sent content of new messages to server");
-  up_tags = send_tags(db, "tags ", out);
-  pending += up_tags;
-  print_time("sent modified tags to server");
-  out << "commit\n";
-
-  if (opt_verbose)
-    cerr << "sent " << up_body << " messages, "
-	 << up_links << " link changes, "
-	 << up_tags << " tag changes\n";
-
-  while (pending-- > 0)
-    get_response(in, line);
-  get_response(in, line);
-  print_time("commit succeeded on server");
-
-  if (!opt_upbg || opt_verbose) {
-    int w = 5;
-    cerr << "SUMMARY:\n"
-	 << "  received " << setw(w) << down_body << " messages, "
-	 << setw(w) << down_links << " link changes, "
-	 << setw(w) << down_tags << " tag changes\n";
-    cerr << "      sent " << setw(w) << up_body << " messages, "
-	 << setw(w) << up_links << " link changes, "
-	 << setw(w) << up_tags << " tag changes\n";
   }
 }
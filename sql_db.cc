@@ -1,4 +1,6 @@
 
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iomanip>
 #include <iostream>
@@ -13,7 +15,7 @@
 
 using namespace std;
 
-const char dbvers[] = "muchsync 0";
+const char dbvers[] = "muchsync 2";
 
 const char muchsync_schema[] = R"(
 -- General table
@@ -29,16 +31,21 @@ CREATE TABLE xapian_dirs (
   dir_path TEXT UNIQUE NOT NULL,
   dir_docid INTEGER PRIMARY KEY,
   dir_mtime INTEGER);
+CREATE TABLE tag_names (
+  tag_id INTEGER PRIMARY KEY,
+  tag TEXT UNIQUE NOT NULL);
 CREATE TABLE tags (
-  tag TEXT NOT NULL,
+  tag_id INTEGER NOT NULL,
   docid INTEGER NOT NULL,
-  UNIQUE (docid, tag),
-  UNIQUE (tag, docid));
+  UNIQUE (docid, tag_id),
+  UNIQUE (tag_id, docid));
 CREATE TABLE message_ids (
-  message_id TEXT UNIQUE NOT NULL,
+  message_id TEXT NOT NULL,
+  msgid_fp INTEGER NOT NULL,
   docid INTEGER PRIMARY KEY,
   replica INTEGER,
   version INTEGER);
+CREATE INDEX message_ids_msgid_fp ON message_ids (msgid_fp);
 CREATE INDEX message_ids_writestamp ON message_ids (replica, version);
 CREATE TABLE xapian_files (
   dir_docid INTEGER NOT NULL,
@@ -51,12 +58,11 @@ CREATE TABLE xapian_files (
 CREATE INDEX xapian_files_hash_id ON xapian_files (hash_id, dir_docid);
 CREATE TABLE maildir_hashes (
   hash_id INTEGER PRIMARY KEY,
-  hash TEXT UNIQUE NOT NULL,
+  hash BLOB UNIQUE NOT NULL,
   size INTEGER,
   message_id TEXT,
   replica INTEGER,
   version INTEGER);
-CREATE INDEX maildir_hashes_message_id ON maildir_hashes (message_id);
 CREATE INDEX maildir_hashes_writestamp ON maildir_hashes (replica, version);
 CREATE TABLE xapian_nlinks (
   hash_id INTEGER NOT NULL,
@@ -65,6 +71,301 @@ CREATE TABLE xapian_nlinks (
   PRIMARY KEY (hash_id, dir_docid));
 )";
 
+/* Every replica appearing in a writestamp in message_ids or
+ * maildir_hashes, with the number of rows that mention it, so the
+ * replicas can be listed without scanning those tables.  Added to
+ * existing databases by dbopen. */
+const char replicas_schema[] = R"(
+CREATE TABLE replicas (
+  replica INTEGER PRIMARY KEY,
+  refcount INTEGER NOT NULL);
+CREATE TRIGGER message_ids_replica_insert AFTER INSERT ON message_ids
+  WHEN new.replica NOT NULL BEGIN
+  INSERT OR IGNORE INTO replicas (replica, refcount) VALUES (new.replica, 0);
+  UPDATE replicas SET refcount = refcount + 1 WHERE replica = new.replica;
+END;
+CREATE TRIGGER message_ids_replica_delete AFTER DELETE ON message_ids
+  WHEN old.replica NOT NULL BEGIN
+  UPDATE replicas SET refcount = refcount - 1 WHERE replica = old.replica;
+END;
+CREATE TRIGGER message_ids_replica_update AFTER UPDATE OF replica ON message_ids
+  WHEN new.replica IS NOT old.replica BEGIN
+  INSERT OR IGNORE INTO replicas (replica, refcount)
+    SELECT new.replica, 0 WHERE new.replica NOT NULL;
+  UPDATE replicas SET refcount = refcount + 1 WHERE replica = new.replica;
+  UPDATE replicas SET refcount = refcount - 1 WHERE replica = old.replica;
+END;
+CREATE TRIGGER maildir_hashes_replica_insert AFTER INSERT ON maildir_hashes
+  WHEN new.replica NOT NULL BEGIN
+  INSERT OR IGNORE INTO replicas (replica, refcount) VALUES (new.replica, 0);
+  UPDATE replicas SET refcount = refcount + 1 WHERE replica = new.replica;
+END;
+CREATE TRIGGER maildir_hashes_replica_delete AFTER DELETE ON maildir_hashes
+  WHEN old.replica NOT NULL BEGIN
+  UPDATE replicas SET refcount = refcount - 1 WHERE replica = old.replica;
+END;
+CREATE TRIGGER maildir_hashes_replica_update
+  AFTER UPDATE OF replica ON maildir_hashes
+  WHEN new.replica IS NOT old.replica BEGIN
+  INSERT OR IGNORE INTO replicas (replica, refcount)
+    SELECT new.replica, 0 WHERE new.replica NOT NULL;
+  UPDATE replicas SET refcount = refcount + 1 WHERE replica = new.replica;
+  UPDATE replicas SET refcount = refcount - 1 WHERE replica = old.replica;
+END;
+)";
+
+const char replicas_fill[] = R"(
+INSERT INTO replicas (replica, refcount)
+  SELECT replica, sum(n) FROM
+    (SELECT replica, count(*) AS n FROM message_ids
+       WHERE replica NOT NULL GROUP BY replica
+     UNION ALL
+     SELECT replica, count(*) AS n FROM maildir_hashes
+       WHERE replica NOT NULL GROUP BY replica)
+  GROUP BY replica;)";
+
+/* The serialized link and tag records that send_links and send_tags
+ * would produce for each hash and message, so the changes a peer is
+ * missing are a range scan on writestamp.  Triggers on the underlying
+ * tables note which entries are out of date in journal_dirty, and
+ * flush_journal rewrites those before the journal is read.  Rewriting
+ * an entry replaces the one it supersedes, so the journal holds one
+ * entry per hash or message.  kind is 'L' (id is a hash_id) or 'T'
+ * (id is a docid). */
+const char journal_schema[] = R"(
+CREATE TABLE change_journal (
+  kind TEXT NOT NULL,
+  id INTEGER NOT NULL,
+  replica INTEGER,
+  version INTEGER,
+  record TEXT NOT NULL,
+  PRIMARY KEY (kind, id));
+CREATE INDEX change_journal_writestamp
+  ON change_journal (kind, replica, version);
+CREATE TABLE journal_dirty (
+  kind TEXT NOT NULL,
+  id INTEGER NOT NULL,
+  PRIMARY KEY (kind, id));
+CREATE TRIGGER journal_hash_insert AFTER INSERT ON maildir_hashes BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('L', new.hash_id); END;
+CREATE TRIGGER journal_hash_update AFTER UPDATE ON maildir_hashes BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('L', old.hash_id);
+  INSERT OR IGNORE INTO journal_dirty VALUES ('L', new.hash_id); END;
+CREATE TRIGGER journal_hash_delete AFTER DELETE ON maildir_hashes BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('L', old.hash_id); END;
+CREATE TRIGGER journal_nlinks_insert AFTER INSERT ON xapian_nlinks BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('L', new.hash_id); END;
+CREATE TRIGGER journal_nlinks_update AFTER UPDATE ON xapian_nlinks BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('L', old.hash_id);
+  INSERT OR IGNORE INTO journal_dirty VALUES ('L', new.hash_id); END;
+CREATE TRIGGER journal_nlinks_delete AFTER DELETE ON xapian_nlinks BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('L', old.hash_id); END;
+CREATE TRIGGER journal_dir_delete AFTER DELETE ON xapian_dirs BEGIN
+  INSERT OR IGNORE INTO journal_dirty
+    SELECT 'L', hash_id FROM xapian_nlinks WHERE dir_docid = old.dir_docid;
+END;
+CREATE TRIGGER journal_dir_update AFTER UPDATE OF dir_path ON xapian_dirs BEGIN
+  INSERT OR IGNORE INTO journal_dirty
+    SELECT 'L', hash_id FROM xapian_nlinks WHERE dir_docid = old.dir_docid;
+END;
+CREATE TRIGGER journal_msgid_insert AFTER INSERT ON message_ids BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('T', new.docid); END;
+CREATE TRIGGER journal_msgid_update AFTER UPDATE ON message_ids BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('T', old.docid);
+  INSERT OR IGNORE INTO journal_dirty VALUES ('T', new.docid); END;
+CREATE TRIGGER journal_msgid_delete AFTER DELETE ON message_ids BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('T', old.docid); END;
+)";
+
+/* Part of journal_schema, but also needed when a migration rebuilds
+ * the tags table. */
+const char journal_tag_triggers[] = R"(
+CREATE TRIGGER journal_tag_insert AFTER INSERT ON tags BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('T', new.docid); END;
+CREATE TRIGGER journal_tag_delete AFTER DELETE ON tags BEGIN
+  INSERT OR IGNORE INTO journal_dirty VALUES ('T', old.docid); END;
+)";
+
+const char journal_fill[] = R"(
+INSERT INTO journal_dirty SELECT 'L', hash_id FROM maildir_hashes;
+INSERT INTO journal_dirty SELECT 'T', docid FROM message_ids;)";
+
+static bool
+table_exists (sqlite3 *db, const char *table)
+{
+  return sqlstmt_t (db, "SELECT 1 FROM sqlite_master"
+		    " WHERE type = 'table' AND name = ?;").param(table)
+    .step().row();
+}
+
+/* Bring a database created by an older muchsync up to date with
+ * tables that are not in muchsync_schema, if table does not exist. */
+static void
+add_table (sqlite3 *db, const char *table, const char *schema,
+	   const char *fill)
+{
+  if (table_exists (db, table))
+    return;
+  sqlexec (db, "BEGIN IMMEDIATE;");
+  try {
+    sqlexec (db, schema);
+    if (!strcmp (table, "change_journal"))
+      sqlexec (db, journal_tag_triggers);
+    sqlexec (db, fill);
+    sqlexec (db, "COMMIT;");
+  }
+  catch (...) {
+    sqlexec (db, "ROLLBACK;");
+    throw;
+  }
+}
+
+/* muchsync 0 -> 1: tags refer to tag_names by ID. */
+static void
+migrate_tag_names (sqlite3 *db)
+{
+  sqlexec (db, R"(
+CREATE TABLE tag_names (
+  tag_id INTEGER PRIMARY KEY,
+  tag TEXT UNIQUE NOT NULL);
+INSERT INTO tag_names (tag) SELECT DISTINCT tag FROM tags ORDER BY tag;
+ALTER TABLE tags RENAME TO old_tags;
+CREATE TABLE tags (
+  tag_id INTEGER NOT NULL,
+  docid INTEGER NOT NULL,
+  UNIQUE (docid, tag_id),
+  UNIQUE (tag_id, docid));
+INSERT INTO tags (tag_id, docid)
+  SELECT tag_id, docid FROM old_tags JOIN tag_names USING (tag);
+DROP TABLE old_tags;)");
+  // The journal triggers on tags went with old_tags
+  if (table_exists (db, "change_journal"))
+    sqlexec (db, journal_tag_triggers);
+}
+
+/* SQL versions of hash_to_key and msgid_fp, for migrations */
+static void
+sql_hash_to_key (sqlite3_context *ctx, int, sqlite3_value **argv)
+{
+  string hash (reinterpret_cast<const char *>
+	       (sqlite3_value_text (argv[0])),
+	       sqlite3_value_bytes (argv[0]));
+  string key = hash_to_key (hash);
+  if (key.empty())
+    sqlite3_result_null (ctx);
+  else
+    sqlite3_result_blob (ctx, key.data(), key.size(), SQLITE_TRANSIENT);
+}
+
+static void
+sql_msgid_fp (sqlite3_context *ctx, int, sqlite3_value **argv)
+{
+  string msgid (reinterpret_cast<const char *>
+		(sqlite3_value_text (argv[0])),
+		sqlite3_value_bytes (argv[0]));
+  sqlite3_result_int64 (ctx, msgid_fp (msgid));
+}
+
+/* Run the statements in sql, which replace table with the new_ table
+ * they create, then re-create the triggers on the old table, which
+ * went with it. */
+static void
+rebuild_table (sqlite3 *db, const char *table, const char *sql)
+{
+  vector<string> triggers;
+  sqlstmt_t t (db, "SELECT sql FROM sqlite_master"
+	       " WHERE type = 'trigger' AND tbl_name = ?;");
+  for (t.param(table).step(); t.row(); t.step())
+    triggers.push_back (t.str(0));
+  sqlexec (db, sql);
+  for (const string &trigger : triggers)
+    sqlexec (db, "%s;", trigger.c_str());
+}
+
+/* muchsync 1 -> 2: hashes are stored in binary, and message IDs are
+ * looked up through the msgid_fp index rather than a UNIQUE index on
+ * the text, so whatever adds a row must check that the ID is not
+ * there already.  The index on maildir_hashes.message_id was
+ * unused. */
+static void
+migrate_binary_keys (sqlite3 *db)
+{
+  sqlite3_create_function (db, "hash_to_key", 1,
+			   SQLITE_UTF8|SQLITE_DETERMINISTIC, nullptr,
+			   sql_hash_to_key, nullptr, nullptr);
+  sqlite3_create_function (db, "msgid_fp", 1,
+			   SQLITE_UTF8|SQLITE_DETERMINISTIC, nullptr,
+			   sql_msgid_fp, nullptr, nullptr);
+  rebuild_table (db, "maildir_hashes", R"(
+CREATE TABLE new_maildir_hashes (
+  hash_id INTEGER PRIMARY KEY,
+  hash BLOB UNIQUE NOT NULL,
+  size INTEGER,
+  message_id TEXT,
+  replica INTEGER,
+  version INTEGER);
+INSERT INTO new_maildir_hashes
+  SELECT hash_id, hash_to_key(hash), size, message_id, replica, version
+  FROM maildir_hashes;
+DROP TABLE maildir_hashes;
+ALTER TABLE new_maildir_hashes RENAME TO maildir_hashes;
+CREATE INDEX maildir_hashes_writestamp ON maildir_hashes (replica, version);)");
+  rebuild_table (db, "message_ids", R"(
+CREATE TABLE new_message_ids (
+  message_id TEXT NOT NULL,
+  msgid_fp INTEGER NOT NULL,
+  docid INTEGER PRIMARY KEY,
+  replica INTEGER,
+  version INTEGER);
+INSERT INTO new_message_ids
+  SELECT message_id, msgid_fp(message_id), docid, replica, version
+  FROM message_ids;
+DROP TABLE message_ids;
+ALTER TABLE new_message_ids RENAME TO message_ids;
+CREATE INDEX message_ids_msgid_fp ON message_ids (msgid_fp);
+CREATE INDEX message_ids_writestamp ON message_ids (replica, version);)");
+}
+
+/* Schema changes, each taking a database from one dbvers to the
+ * next, applied in order by dbopen. */
+static const struct {
+  const char *from;
+  const char *to;
+  void (*migrate) (sqlite3 *);
+} migrations[] = {
+  { "muchsync 0", "muchsync 1", migrate_tag_names },
+  { "muchsync 1", "muchsync 2", migrate_binary_keys },
+};
+
+/* Returns false if db has an unknown version. */
+static bool
+migrate (sqlite3 *db)
+{
+  string vers = getconfig<string> (db, "dbvers");
+  while (vers != dbvers) {
+    auto m = find_if (begin (migrations), end (migrations),
+		      [&vers](decltype(migrations[0]) &m) {
+			return vers == m.from;
+		      });
+    if (m == end (migrations))
+      return false;
+    sqlexec (db, "BEGIN EXCLUSIVE;");
+    try {
+      if (getconfig<string> (db, "dbvers") == vers) {
+	m->migrate (db);
+	setconfig (db, "dbvers", m->to);
+      }
+      sqlexec (db, "COMMIT;");
+    }
+    catch (...) {
+      sqlexec (db, "ROLLBACK;");
+      throw;
+    }
+    vers = getconfig<string> (db, "dbvers");
+  }
+  return true;
+}
+
 static sqlite3 *
 dbcreate (const char *path)
 {
@@ -88,25 +389,69 @@ dbcreate (const char *path)
   try {
     sqlexec (db, "BEGIN;");
     sqlexec (db, muchsync_schema);
+    sqlexec (db, replicas_schema);
+    sqlexec (db, journal_schema);
+    sqlexec (db, journal_tag_triggers);
     setconfig (db, "dbvers", dbvers);
     setconfig (db, "self", self);
     sqlexec (db, "INSERT INTO sync_vector (replica, version)"
 	     " VALUES (%lld, 1);", self);
     sqlexec (db, "COMMIT;");
   } catch (sqlerr_t exc) {
-    sqlite3_close_v2 (db);
+    sqlclose (db);
     cerr << exc.what () << '\n';
     return nullptr;
   }
   return db;
 }
 
+namespace {
+struct profile_settings {
+  const char *name;
+  const char *synchronous;
+  i64 cache_kib;
+  i64 mmap_bytes;
+  int wal_autocheckpoint;	// In pages
+};
+/* Indexed by db_profile.  With a write-ahead log, synchronous=NORMAL
+ * can lose the last commits to a power failure, but never corrupts
+ * the database.  temp_store is left alone, as changing it drops all
+ * temporary tables. */
+const profile_settings db_profiles[] = {
+  { "interactive", "FULL", 16 * 1024, 0, 1000 },
+  { "bulk", "NORMAL", 256 * 1024, i64 (1) << 30, 16 * 1024 },
+};
+}
+
+void
+set_db_profile (sqlite3 *db, db_profile p)
+{
+  const profile_settings &ps = db_profiles[int (p)];
+  bool outside = sqlite3_get_autocommit (db);
+  sqlexec (db, "PRAGMA cache_size = %lld; PRAGMA mmap_size = %lld;"
+	   " PRAGMA wal_autocheckpoint = %d;",
+	   -ps.cache_kib, ps.mmap_bytes, ps.wal_autocheckpoint);
+  if (outside) {
+    // 1 is NORMAL, 2 FULL
+    i64 was = sqlstmt_t (db, "PRAGMA synchronous;").step().integer(0);
+    sqlexec (db, "PRAGMA synchronous = %s;", ps.synchronous);
+    if (was < 2 && p == db_profile::interactive)
+      sqlexec (db, "PRAGMA wal_checkpoint(FULL);");
+  }
+  if (opt_verbose > 1)
+    cerr << "database profile " << ps.name
+	 << (outside ? "\n" : " (synchronous level unchanged)\n");
+}
+
 sqlite3 *
 dbopen (const char *path, bool exclusive)
 {
   sqlite3 *db = nullptr;
-  if (access (path, 0) && errno == ENOENT)
+  if (access (path, 0) && errno == ENOENT) {
     db = dbcreate (path);
+    if (db && !exclusive)
+      sqlexec(db, "PRAGMA locking_mode=NORMAL;");
+  }
   else {
     sqlite3_open_v2 (path, &db, SQLITE_OPEN_READWRITE, nullptr);
     if (exclusive)
@@ -116,23 +461,33 @@ dbopen (const char *path, bool exclusive)
     return nullptr;
 
   sqlexec (db, "PRAGMA secure_delete = 0;");
+  // Several server processes may share the database (--channels)
+  sqlite3_busy_timeout (db, 30000);
+  // After the locking mode, which is fixed once a log is in use
+  sqlexec (db, "PRAGMA journal_mode = WAL;");
+  // Give back the space of a log that a long transaction blew up
+  sqlexec (db, "PRAGMA journal_size_limit = %lld;", i64 (64) << 20);
+  set_db_profile (db, db_profile::interactive);
 
   try {
-    if (getconfig<string> (db, "dbvers") != dbvers) {
+    if (!migrate (db)) {
       cerr << path << ": invalid database version\n";
-      sqlite3_close_v2 (db);
+      sqlclose (db);
       return nullptr;
     }
     getconfig<i64> (db, "self");
+    add_table (db, "replicas", replicas_schema, replicas_fill);
+    add_table (db, "change_journal", journal_schema, journal_fill);
+    load_tag_names (db);
   }
   catch (sqldone_t) {
     cerr << path << ": invalid configuration\n";
-    sqlite3_close_v2 (db);
+    sqlclose (db);
     return nullptr;
   }
   catch (sqlerr_t &e) {
     cerr << path << ": " << e.what() << '\n';
-    sqlite3_close_v2 (db);
+    sqlclose (db);
     return nullptr;
   }
 
@@ -191,18 +546,11 @@ show_sync_vector (const versvector &vv)
   return sb.str();
 }
 
-string
-permissive_percent_encode (const string &raw)
-{
-  ostringstream outbuf;
-  outbuf.fill('0');
-  outbuf.setf(ios::hex, ios::basefield);
-  for (char c : raw)
-    if (c <= ' ' || c >= '\177' || c == '%' || c == '(' || c == ')')
-      outbuf << '%' << setw(2) << int (uint8_t(c));
-    else
-      outbuf << c;
-  return outbuf.str();
+/* Write permissive_percent_encode(raw) to os without building it */
+static inline void
+put_encoded (ostream &os, const string &raw)
+{
+  permissive_percent_encode (raw.data(), raw.size(), os);
 }
 
 template<typename C, typename F> inline void
@@ -218,16 +566,294 @@ intercalate (const C &c, F &&each, function<void()> between)
   }
 }
 
+/* In-memory copy of the tag_names table of one connection.  Each
+ * connection gets its own, so IDs interned in one database are never
+ * looked up in another. */
+struct tag_dict {
+  sqlite3 *db;
+  unordered_map<string,tag_id> ids;
+  unordered_map<tag_id,string> names;
+};
+static unordered_map<sqlite3 *, tag_dict *> tag_dicts;
+// The dictionary of the database last loaded, for the stream operators
+static tag_dict *cur_dict;
+
+static void
+tag_dict_func (sqlite3_context *ctx, int, sqlite3_value **)
+{
+  sqlite3_result_null (ctx);
+}
+
+static void
+destroy_tag_dict (void *p)
+{
+  tag_dict *d = static_cast<tag_dict *> (p);
+  tag_dicts.erase (d->db);
+  if (cur_dict == d)
+    cur_dict = nullptr;
+  delete d;
+}
+
+static tag_dict &
+get_tag_dict (sqlite3 *db)
+{
+  auto i = tag_dicts.find (db);
+  if (i == tag_dicts.end())
+    throw logic_error ("intern_tag: tag names not loaded");
+  return *i->second;
+}
+
+void
+load_tag_names (sqlite3 *db)
+{
+  auto i = tag_dicts.find (db);
+  tag_dict *d;
+  if (i != tag_dicts.end())
+    d = i->second;
+  else {
+    d = new tag_dict { db, {}, {} };
+    // A function owning d lets sqlite free it with the connection
+    if (sqlite3_create_function_v2 (db, "muchsync_tag_dict", 0, SQLITE_UTF8,
+				    d, tag_dict_func, nullptr, nullptr,
+				    destroy_tag_dict) != SQLITE_OK) {
+      delete d;
+      throw sqlerr_t (string ("load_tag_names: ") + sqlite3_errmsg (db));
+    }
+    tag_dicts.emplace (db, d);
+  }
+  cur_dict = d;
+  d->ids.clear();
+  d->names.clear();
+  sqlstmt_t s (db, "SELECT tag_id, tag FROM tag_names;");
+  for (s.step(); s.row(); s.step()) {
+    d->ids.emplace (s.str(1), s.integer(0));
+    d->names.emplace (s.integer(0), s.str(1));
+  }
+}
+
+tag_id
+intern_tag (sqlite3 *db, const string &name)
+{
+  tag_dict &d = get_tag_dict (db);
+  auto i = d.ids.find (name);
+  if (i != d.ids.end())
+    return i->second;
+  // Another process sharing the database may have added it already
+  sqlstmt_t (db, "INSERT OR IGNORE INTO tag_names (tag) VALUES (?);")
+    .param(name).step();
+  tag_id id = sqlstmt_t (db, "SELECT tag_id FROM tag_names WHERE tag = ?;")
+    .param(name).step().integer(0);
+  d.ids.emplace (name, id);
+  d.names.emplace (id, name);
+  return id;
+}
+
+const string &
+tag_name (sqlite3 *db, tag_id id)
+{
+  tag_dict &d = get_tag_dict (db);
+  auto i = d.names.find (id);
+  if (i != d.names.end())
+    return i->second;
+  sqlstmt_t s (db, "SELECT tag FROM tag_names WHERE tag_id = ?;");
+  if (s.param(id).step().row()) {
+    d.ids.emplace (s.str(0), id);
+    return d.names.emplace (id, s.str(0)).first->second;
+  }
+  throw runtime_error ("unknown tag id " + to_string (id));
+}
+
+tag_id
+intern_tag (const string &name)
+{
+  if (!cur_dict)
+    throw logic_error ("intern_tag: tag names not loaded");
+  return intern_tag (cur_dict->db, name);
+}
+
+const string &
+tag_name (tag_id id)
+{
+  if (!cur_dict)
+    throw runtime_error ("unknown tag id " + to_string (id));
+  return tag_name (cur_dict->db, id);
+}
+
+unordered_set<string>
+tag_set::names(sqlite3 *db) const
+{
+  unordered_set<string> ret;
+  for (tag_id id : ids_)
+    ret.insert (tag_name (db, id));
+  return ret;
+}
+
+unordered_set<string>
+tag_set::names() const
+{
+  if (!cur_dict)
+    throw logic_error ("tag_set::names: tag names not loaded");
+  return names (cur_dict->db);
+}
+
+i64
+msgid_fp (const string &message_id)
+{
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325;
+  for (unsigned char c : message_id)
+    h = (h ^ c) * 0x100000001b3;
+  return i64 (h);
+}
+
+static const int wire_codec_index = ios_base::xalloc();
+
+void
+set_wire_codec (ios_base &s, wire_codec *codec)
+{
+  s.pword (wire_codec_index) = codec;
+}
+
+wire_codec *
+get_wire_codec (ios_base &s)
+{
+  return static_cast<wire_codec *> (s.pword (wire_codec_index));
+}
+
+/* Split "<id>[=<name>]", with name set to nullptr if absent. */
+static bool
+parse_dict_ref (const string &ref, i64 *id, const char **name)
+{
+  char *end;
+  *id = strtoll (ref.c_str(), &end, 10);
+  if (end == ref.c_str())
+    return false;
+  if (!*end)
+    *name = nullptr;
+  else if (*end == '=')
+    *name = end + 1;
+  else
+    return false;
+  return true;
+}
+
+void
+dir_table::load (sqlite3 *db)
+{
+  db_ = db;
+  ids_.clear();
+  paths_.clear();
+  sqlstmt_t s (db, "SELECT dir_path, dir_docid FROM xapian_dirs;");
+  while (s.step().row()) {
+    ids_.emplace (s.str(0), s.integer(1));
+    paths_.emplace (s.integer(1), s.str(0));
+  }
+}
+
+i64
+dir_table::id (const string &path)
+{
+  auto i = ids_.find (path);
+  if (i != ids_.end())
+    return i->second;
+  i64 id = -++unknown_;
+  if (db_) {
+    sqlstmt_t s (db_, "SELECT dir_docid FROM xapian_dirs"
+		 " WHERE dir_path = ?;");
+    if (s.param(path).step().row()) {
+      id = s.integer(0);
+      --unknown_;
+    }
+  }
+  ids_.emplace (path, id);
+  paths_.emplace (id, path);
+  return id;
+}
+
+const string *
+dir_table::path (i64 id)
+{
+  auto i = paths_.find (id);
+  if (i != paths_.end())
+    return &i->second;
+  if (!db_ || id < 0)
+    return nullptr;
+  sqlstmt_t s (db_, "SELECT dir_path FROM xapian_dirs WHERE dir_docid = ?;");
+  if (!s.param(id).step().row())
+    return nullptr;
+  ids_.emplace (s.str(0), id);
+  return &paths_.emplace (id, s.str(0)).first->second;
+}
+
+/* Add the links of one directory of an `l` record to hi, under its
+ * local dir_docid if the codec can tell it, and otherwise under its
+ * path.  Returns false if the directory is unknown. */
+static bool
+decode_dir (wire_codec *codec, const string &dir, i64 nlinks, hash_info &hi)
+{
+  i64 id;
+  const char *name;
+  if (!parse_dict_ref (dir, &id, &name))
+    return false;
+  if (codec->local_ids) {
+    const string *path = codec->local_dirs->path (id);
+    if (path)
+      hi.dirs.emplace (*path, nlinks);
+    return path;
+  }
+  if (codec->resolve_epoch
+      && *codec->resolve_epoch != codec->peer_dir_epoch) {
+    codec->peer_dir_docids.clear();
+    codec->peer_dir_epoch = *codec->resolve_epoch;
+  }
+  if (name) {
+    percent_decode (name, dir.c_str() + dir.size() - name,
+		    &codec->peer_dirs[id]);
+    codec->peer_dir_docids.erase (id);
+  }
+  auto d = codec->peer_dir_docids.find (id);
+  if (d != codec->peer_dir_docids.end()) {
+    hi.dir_docids.emplace (d->second, nlinks);
+    return true;
+  }
+  auto i = codec->peer_dirs.find (id);
+  if (i == codec->peer_dirs.end())
+    return false;
+  if (codec->resolve_dir) {
+    i64 docid = codec->resolve_dir (i->second);
+    if (docid >= 0) {
+      codec->peer_dir_docids.emplace (id, docid);
+      hi.dir_docids.emplace (docid, nlinks);
+      return true;
+    }
+  }
+  hi.dirs.emplace (i->second, nlinks);
+  return true;
+}
+
 ostream &
 operator<< (ostream &os, const hash_info &hi)
 {
-  os << "L " << hi.hash << ' ' << hi.size << ' '
-     << permissive_percent_encode(hi.message_id)
-     << " R" << hi.hash_stamp.first << '=' << hi.hash_stamp.second
+  wire_codec *codec = get_wire_codec (os);
+  if (codec && !codec->dirs)
+    codec = nullptr;
+  os << (codec ? "l " : "L ") << hi.hash << ' ' << hi.size << ' ';
+  put_encoded (os, hi.message_id);
+  os << " R" << hi.hash_stamp.first << '=' << hi.hash_stamp.second
      << " (";
   intercalate (hi.dirs,
 	       [&](decltype(hi.dirs.begin()) i) {
-		 os << i->second << '*' << permissive_percent_encode(i->first);
+		 os << i->second << '*';
+		 if (!codec) {
+		   put_encoded (os, i->first);
+		   return;
+		 }
+		 i64 id = codec->local_dirs->id (i->first);
+		 os << id;
+		 if (codec->dirs_sent.insert(id).second) {
+		   os << '=';
+		   put_encoded (os, i->first);
+		 }
 	       },
 	       [&]() {os << ' ';});
   os << ')';
@@ -240,9 +866,16 @@ operator>> (istream &is, hash_info &hi)
   string hash, msgid;
   size_t size;
   writestamp stamp;
-  decltype(hi.dirs) d;
+  hash_info links;
 
-  input_match(is, 'L') >> hash >> size >> msgid;
+  char kind = 0;
+  is >> skipws >> kind;
+  wire_codec *codec = kind == 'l' ? get_wire_codec (is) : nullptr;
+  if (kind != 'L' && !codec) {
+    is.setstate (ios_base::failbit);
+    return is;
+  }
+  is >> hash >> size >> msgid;
   if (is && !hash_ok(hash))
     is.setstate (ios_base::failbit);
   read_writestamp(is, stamp);
@@ -259,8 +892,14 @@ operator>> (istream &is, hash_info &hi)
       is.putback (')');
       dir.resize(dir.size()-1);
     }
-    if (!dir.empty())
-      d.emplace (percent_decode (dir), nlinks);
+    if (dir.empty())
+      continue;
+    if (!codec)
+      links.dirs.emplace (percent_decode (dir), nlinks);
+    else if (!decode_dir (codec, dir, nlinks, links)) {
+      is.setstate (ios_base::failbit);
+      break;
+    }
   }
 
   if (is.good()) {
@@ -268,7 +907,8 @@ operator>> (istream &is, hash_info &hi)
     hi.size = size;
     hi.message_id = percent_decode (msgid);
     hi.hash_stamp = stamp;
-    hi.dirs = move(d);
+    hi.dirs = move(links.dirs);
+    hi.dir_docids = move(links.dir_docids);
   }
   return is;
 }
@@ -276,24 +916,59 @@ operator>> (istream &is, hash_info &hi)
 ostream &
 operator<< (ostream &os, const tag_info &ti)
 {
-  os << "T " << permissive_percent_encode(ti.message_id)
-     << " R" << ti.tag_stamp.first << '=' << ti.tag_stamp.second
+  wire_codec *codec = get_wire_codec (os);
+  if (codec && !codec->tags)
+    codec = nullptr;
+  os << (codec ? "t " : "T ");
+  put_encoded (os, ti.message_id);
+  os << " R" << ti.tag_stamp.first << '=' << ti.tag_stamp.second
      << " (";
-  intercalate (ti.tags,
-	       [&](decltype(ti.tags.begin()) i) {
-		 os << *i;
-	       },
-	       [&]() {os << ' ';});
+  bool first = true;
+  for (tag_id id : ti.tags) {
+    const string &name = tag_name (id);
+    if (name.empty())		// Local placeholder, see msg_sync::flush_index
+      continue;
+    if (!first)
+      os << ' ';
+    first = false;
+    if (!codec)
+      os << name;
+    else if (codec->tags_sent.insert(id).second)
+      os << id << '=' << name;
+    else
+      os << id;
+  }
   os << ')';
   return os;
 }
 
+/* Map one tag of a `t` record to a local ID, or return -1. */
+static tag_id
+decode_tag (wire_codec *codec, const string &tag)
+{
+  i64 peer_id;
+  const char *name;
+  if (!parse_dict_ref (tag, &peer_id, &name))
+    return -1;
+  if (name)
+    codec->peer_tags[peer_id] = intern_tag (name);
+  auto i = codec->peer_tags.find (peer_id);
+  return i == codec->peer_tags.end() ? -1 : i->second;
+}
+
 istream &
 operator>> (istream &is, tag_info &ti)
 {
+  char kind = 0;
+  is >> skipws >> kind;
+  wire_codec *codec = kind == 't' ? get_wire_codec (is) : nullptr;
+  if (kind != 'T' && !codec) {
+    is.setstate (ios_base::failbit);
+    return is;
+  }
   {
     string msgid;
-    input_match(is, 'T') >> msgid;
+    is >> msgid;
     ti.message_id = percent_decode (msgid);
   }
   read_writestamp(is, ti.tag_stamp);
@@ -308,21 +983,218 @@ operator>> (istream &is, tag_info &ti)
       is.putback (')');
       tag.resize(tag.size()-1);
     }
-    if (!tag.empty())
-      ti.tags.insert(tag);
+    if (tag.empty())
+      continue;
+    if (!codec)
+      ti.tags.insert(intern_tag (tag));
+    else {
+      tag_id id = decode_tag (codec, tag);
+      if (id < 0) {
+	is.setstate (ios_base::failbit);
+	break;
+      }
+      ti.tags.insert(id);
+    }
   }
   return is;
 }
 
+record_parser &
+record_parser::reset (const string &line, size_t pos)
+{
+  p_ = line.data() + min (pos, line.size());
+  end_ = line.data() + line.size();
+  return *this;
+}
+
+void
+record_parser::skip_space ()
+{
+  while (p_ < end_ && isspace (static_cast<unsigned char> (*p_)))
+    p_++;
+}
+
+/* Like is >> c */
+bool
+record_parser::next_char (char *c)
+{
+  skip_space();
+  if (p_ == end_)
+    return false;
+  *c = *p_++;
+  return true;
+}
+
+bool
+record_parser::match (char want)
+{
+  char c;
+  return next_char (&c) && c == want;
+}
+
+/* Like is >> s */
+bool
+record_parser::token (const char **s, size_t *n)
+{
+  skip_space();
+  *s = p_;
+  while (p_ < end_ && !isspace (static_cast<unsigned char> (*p_)))
+    p_++;
+  *n = p_ - *s;
+  return *n > 0;
+}
+
+/* A token inside parentheses, less any closing parenthesis it runs
+ * into, which is left for list() to see. */
+bool
+record_parser::list_item (const char **s, size_t *n)
+{
+  if (!token (s, n))
+    return false;
+  if ((*s)[*n-1] == ')') {
+    --*n;
+    --p_;
+  }
+  return true;
+}
+
+bool
+record_parser::number (i64 *v)
+{
+  skip_space();
+  const char *start = p_;
+  bool neg = false;
+  if (p_ < end_ && (*p_ == '-' || *p_ == '+'))
+    neg = *p_++ == '-';
+  if (p_ == end_ || !isdigit (static_cast<unsigned char> (*p_))) {
+    p_ = start;
+    return false;
+  }
+  i64 n = 0;
+  while (p_ < end_ && isdigit (static_cast<unsigned char> (*p_)))
+    n = n * 10 + (*p_++ - '0');
+  *v = neg ? -n : n;
+  return true;
+}
+
+bool
+record_parser::stamp (writestamp *ws)
+{
+  return match ('R') && number (&ws->first)
+    && match ('=') && number (&ws->second);
+}
+
+/* Parse "(item ...)", calling item() for each element. */
+template<typename F> bool
+record_parser::list (F &&item)
+{
+  if (!match ('('))
+    return false;
+  for (;;) {
+    skip_space();
+    if (p_ == end_)
+      return false;
+    if (*p_ == ')') {
+      p_++;
+      return true;
+    }
+    if (!item())
+      return false;
+  }
+}
+
+bool
+record_parser::parse (hash_info &hi)
+{
+  char kind;
+  if (!next_char (&kind))
+    return false;
+  wire_codec *codec = kind == 'l' ? codec_ : nullptr;
+  if (kind != 'L' && !codec)
+    return false;
+  const char *s;
+  size_t n;
+  if (!token (&s, &n))
+    return false;
+  hi.hash.assign (s, n);
+  const char *msgid;
+  size_t msgid_len;
+  if (!hash_ok (hi.hash) || !number (&hi.size)
+      || !token (&msgid, &msgid_len) || !stamp (&hi.hash_stamp))
+    return false;
+  hi.dirs.clear();
+  hi.dir_docids.clear();
+  // Like operator>>, only decode the message-ID of a well-formed record
+  bool ok = list ([&]() -> bool {
+      i64 nlinks;
+      const char *s;
+      size_t n;
+      if (!number (&nlinks) || !match ('*') || !list_item (&s, &n))
+	return false;
+      if (!n)
+	return true;
+      if (!codec) {
+	percent_decode (s, n, &field_);
+	hi.dirs.emplace (field_, nlinks);
+	return true;
+      }
+      field_.assign (s, n);
+      return decode_dir (codec, field_, nlinks, hi);
+    });
+  if (ok)
+    percent_decode (msgid, msgid_len, &hi.message_id);
+  return ok;
+}
+
+bool
+record_parser::parse (tag_info &ti)
+{
+  char kind;
+  if (!next_char (&kind))
+    return false;
+  wire_codec *codec = kind == 't' ? codec_ : nullptr;
+  if (kind != 'T' && !codec)
+    return false;
+  const char *s;
+  size_t n;
+  if (!token (&s, &n))
+    return false;
+  percent_decode (s, n, &ti.message_id);
+  if (!stamp (&ti.tag_stamp))
+    return false;
+  ti.tags.clear();
+  return list ([&]() -> bool {
+      const char *s;
+      size_t n;
+      if (!list_item (&s, &n))
+	return false;
+      if (!n)
+	return true;
+      field_.assign (s, n);
+      if (!codec) {
+	ti.tags.insert (intern_tag (field_));
+	return true;
+      }
+      tag_id id = decode_tag (codec, field_);
+      if (id < 0)
+	return false;
+      ti.tags.insert (id);
+      return true;
+    });
+}
+
 hash_lookup::hash_lookup (const string &m, sqlite3 *db)
-  : gethash_(db, "SELECT hash_id, size, message_id, replica, version"
-	     " FROM maildir_hashes WHERE hash = ?;"),
-    getlinks_(db, "SELECT dir_path, name, docid"
-	      " FROM xapian_files JOIN xapian_dirs USING (dir_docid)"
-	      " WHERE hash_id = ?;"),
-    makehash_(db, "INSERT INTO maildir_hashes"
-	      " (hash, size, message_id, replica, version)"
-	      " VALUES (?, ?, ?, ?, ?);"),
+  : gethash_(sqlstmt_t::cached
+	     (db, "SELECT hash_id, size, message_id, replica, version"
+	      " FROM maildir_hashes WHERE hash = ?;")),
+    getlinks_(sqlstmt_t::cached
+	      (db, "SELECT dir_path, name, docid, dir_docid"
+	       " FROM xapian_files JOIN xapian_dirs USING (dir_docid)"
+	       " WHERE hash_id = ?;")),
+    makehash_(sqlstmt_t::cached
+	      (db, "INSERT INTO maildir_hashes"
+	       " (size, message_id, replica, version, hash)"
+	       " VALUES (?, ?, ?, ?, ?);")),
     maildir(m)
 {
 }
@@ -332,24 +1204,29 @@ hash_lookup::lookup (const string &hash)
 {
   ok_ = false;
   content_.close();
-  if (!gethash_.reset().param(hash).step().row())
+  string key = hash_to_key (hash);
+  if (key.empty() || !gethash_.run(sqlbytes(key)).row())
     return false;
-  hash_id_ = gethash_.integer(0);
+  hash_id_ = gethash_.get<0>();
   hi_.hash = hash;
-  hi_.size = gethash_.integer(1);
-  hi_.message_id = gethash_.str(2);
-  hi_.hash_stamp.first = gethash_.integer(3);
-  hi_.hash_stamp.second = gethash_.integer(4);
+  hi_.size = gethash_.get<1>();
+  gethash_.get<2>().assign_to(&hi_.message_id);
+  hi_.hash_stamp.first = gethash_.get<3>();
+  hi_.hash_stamp.second = gethash_.get<4>();
+  gethash_.reset();		// Don't hold a read lock between lookups
   hi_.dirs.clear();
+  hi_.dir_docids.clear();
   links_.clear();
+  link_dirs_.clear();
   docid_ = -1;
-  for (getlinks_.reset().param(hash_id_).step();
-       getlinks_.row(); getlinks_.step()) {
-    string dir = getlinks_.str(0), name = getlinks_.str(1);
+  for (getlinks_.run(hash_id_); getlinks_.row(); getlinks_.step()) {
+    string dir = getlinks_.get<0>().str();
     ++hi_.dirs[dir];
-    links_.emplace_back(dir, name);
+    ++hi_.dir_docids[getlinks_.get<3>()];
+    link_dirs_.push_back(getlinks_.get<3>());
+    links_.emplace_back(move(dir), getlinks_.get<1>().str());
     if (docid_ == -1)
-      docid_ = getlinks_.integer(2);
+      docid_ = getlinks_.get<2>();
   }
   return ok_ = true;
 }
@@ -359,13 +1236,18 @@ hash_lookup::create (const hash_info &rhi)
 {
   ok_ = false;
   content_.close();
-  makehash_.reset().param(rhi.hash, rhi.size, rhi.message_id,
-			  rhi.hash_stamp.first, rhi.hash_stamp.second).step();
+  string key = hash_to_key (rhi.hash);
+  makehash_.reset().param(rhi.size, rhi.message_id,
+			  rhi.hash_stamp.first, rhi.hash_stamp.second)
+    .bind_blob(5, key.data(), key.size()).step();
   hi_.hash = rhi.hash;
   hi_.size = rhi.size;
   hi_.message_id = rhi.message_id;
   hi_.hash_stamp = rhi.hash_stamp;
   hi_.dirs.clear();
+  hi_.dir_docids.clear();
+  links_.clear();
+  link_dirs_.clear();
   hash_id_ = sqlite3_last_insert_rowid(sqlite3_db_handle(makehash_.get()));
   ok_ = true;
 }
@@ -439,9 +1321,10 @@ hash_lookup::content()
 }
 
 tag_lookup::tag_lookup (sqlite3 *db)
-  : getmsg_(db, "SELECT docid, replica, version"
-	    " FROM message_ids WHERE message_id = ?;"),
-    gettags_(db, "SELECT tag FROM tags WHERE docid = ?;")
+  : getmsg_(sqlstmt_t::cached
+	    (db, "SELECT docid, replica, version"
+	     " FROM message_ids WHERE msgid_fp = ? AND message_id = ?;")),
+    gettags_(sqlstmt_t::cached (db, "SELECT tag_id FROM tags WHERE docid = ?;"))
 {
 }
 
@@ -449,15 +1332,16 @@ bool
 tag_lookup::lookup (const string &msgid)
 {
   ok_ = false;
-  if (!getmsg_.reset().param(msgid).step().row())
+  if (!getmsg_.run(msgid_fp(msgid), msgid).row())
     return false;
   ti_.message_id = msgid;
-  docid_ = getmsg_.integer(0);
-  ti_.tag_stamp.first = getmsg_.integer(1);
-  ti_.tag_stamp.second = getmsg_.integer(2);
+  docid_ = getmsg_.get<0>();
+  ti_.tag_stamp.first = getmsg_.get<1>();
+  ti_.tag_stamp.second = getmsg_.get<2>();
+  getmsg_.reset();
   ti_.tags.clear();
-  for (gettags_.reset().param(docid_).step(); gettags_.row(); gettags_.step())
-    ti_.tags.insert(gettags_.str(0));
+  for (gettags_.run(docid_); gettags_.row(); gettags_.step())
+    ti_.tags.insert(gettags_.get<0>());
   return ok_ = true;
 }
 
@@ -471,6 +1355,162 @@ get_sync_vector (sqlite3 *db)
   return vv;
 }
 
+/* The form of hash_info records in change_journal: an `l` record
+ * naming the directories of hi.dir_docids by ID alone. */
+static void
+put_local_links (ostream &os, const hash_info &hi)
+{
+  os << "l " << hi.hash << ' ' << hi.size << ' ';
+  put_encoded (os, hi.message_id);
+  os << " R" << hi.hash_stamp.first << '=' << hi.hash_stamp.second
+     << " (";
+  intercalate (hi.dir_docids,
+	       [&](decltype(hi.dir_docids.begin()) i) {
+		 os << i->second << '*' << i->first;
+	       },
+	       [&]() {os << ' ';});
+  os << ')';
+}
+
+wire_codec
+journal_codec (sqlite3 *db, shared_ptr<dir_table> dirs)
+{
+  wire_codec c;
+  c.local_ids = true;
+  if (dirs)
+    c.local_dirs = dirs;
+  else
+    c.local_dirs->load (db);
+  return c;
+}
+
+void
+put_journal_link (ostream &os, const string &rec, wire_codec &journal)
+{
+  wire_codec *codec = get_wire_codec (os);
+  // Journals written before the dictionary form hold `L` records
+  if (rec.compare (0, 2, "l ")) {
+    os << rec;
+    return;
+  }
+  if (!codec || !codec->dirs) {
+    record_parser rp (&journal);
+    hash_info hi;
+    if (!rp.reset(rec).parse(hi))
+      throw runtime_error ("corrupt change_journal record: " + rec);
+    os << hi;
+    return;
+  }
+  size_t open = rec.find ('('), close = rec.rfind (')');
+  if (open == string::npos || close < open)
+    throw runtime_error ("corrupt change_journal record: " + rec);
+  os.write (rec.data(), open + 1);
+  for (size_t i = open + 1; i < close;) {
+    size_t end = min (rec.find (' ', i), close);
+    size_t star = rec.find ('*', i);
+    if (star >= end)
+      throw runtime_error ("corrupt change_journal record: " + rec);
+    i64 id = atoll (rec.c_str() + star + 1);
+    os.write (rec.data() + i, end - i);
+    if (codec->dirs_sent.insert(id).second) {
+      const string *path = codec->local_dirs->path (id);
+      if (!path)
+	throw runtime_error ("unknown directory in change_journal: " + rec);
+      os << '=';
+      put_encoded (os, *path);
+    }
+    if (end < close)
+      os << ' ';
+    i = end + 1;
+  }
+  os << ')';
+}
+
+/* Rewrite the change_journal entries of every hash and message
+ * listed in journal_dirty, producing exactly the records send_links
+ * and send_tags would otherwise build from the underlying tables. */
+void
+flush_journal (sqlite3 *sqldb)
+{
+  if (!sqlstmt_t::cached (sqldb, "SELECT 1 FROM journal_dirty LIMIT 1;")
+      .step().row())
+    return;
+
+  sqlexec (sqldb, "SAVEPOINT flush_journal;");
+  try {
+    sqlexec (sqldb, R"(
+DELETE FROM change_journal
+  WHERE kind = 'L' AND id IN (SELECT id FROM journal_dirty WHERE kind = 'L');
+DELETE FROM change_journal
+  WHERE kind = 'T' AND id IN (SELECT id FROM journal_dirty WHERE kind = 'T');)");
+    sqlstmt_t put (sqldb, "INSERT INTO change_journal"
+		   " (kind, id, replica, version, record)"
+		   " VALUES (?, ?, ?, ?, ?);");
+
+    sqlstmt_t links (sqldb, R"(
+SELECT h.hash_id, hash, size, message_id, h.replica, h.version,
+       dir_docid, link_count
+FROM (journal_dirty d CROSS JOIN maildir_hashes h
+      ON d.kind = 'L' AND h.hash_id = d.id)
+LEFT OUTER JOIN xapian_nlinks USING (hash_id);)");
+    hash_info hi;
+    links.step();
+    while (links.row()) {
+      i64 hash_id = links.integer(0);
+      hi.hash = hash_from_key (links.str(1));
+      hi.size = links.integer(2);
+      hi.message_id = links.str(3);
+      hi.hash_stamp.first = links.integer(4);
+      hi.hash_stamp.second = links.integer(5);
+      hi.dir_docids.clear();
+      if (links.null(6))
+	links.step();
+      else {
+	hi.dir_docids.emplace(links.integer(6), links.integer(7));
+	while (links.step().row() && links.integer(0) == hash_id)
+	  hi.dir_docids.emplace(links.integer(6), links.integer(7));
+      }
+      ostringstream os;
+      put_local_links (os, hi);
+      put.reset().param("L", hash_id, hi.hash_stamp.first,
+			hi.hash_stamp.second, os.str()).step();
+    }
+
+    sqlstmt_t tags (sqldb, R"(
+SELECT m.docid, m.message_id, m.replica, m.version, tags.tag_id
+FROM (journal_dirty d CROSS JOIN message_ids m
+      ON d.kind = 'T' AND m.docid = d.id)
+      LEFT OUTER JOIN tags USING (docid);)");
+    tag_info ti;
+    tags.step();
+    while (tags.row()) {
+      i64 docid = tags.integer(0);
+      ti.message_id = tags.str(1);
+      ti.tag_stamp.first = tags.integer(2);
+      ti.tag_stamp.second = tags.integer(3);
+      ti.tags.clear();
+      if (tags.null(4))
+	tags.step();
+      else {
+	ti.tags.insert (tags.integer(4));
+	while (tags.step().row() && tags.integer(0) == docid)
+	  ti.tags.insert (tags.integer(4));
+      }
+      ostringstream os;
+      os << ti;
+      put.reset().param("T", docid, ti.tag_stamp.first,
+			ti.tag_stamp.second, os.str()).step();
+    }
+
+    sqlexec (sqldb, "DELETE FROM journal_dirty;");
+    sqlexec (sqldb, "RELEASE flush_journal;");
+  }
+  catch (...) {
+    sqlexec (sqldb, "ROLLBACK TO flush_journal; RELEASE flush_journal;");
+    throw;
+  }
+}
+
 
 #include "muchsync.h"
 
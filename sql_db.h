@@ -7,9 +7,12 @@
  *  \brief Data structures representing information in SQL database.
  */
 
+#include <algorithm>
 #include <exception>
 #include <iosfwd>
 #include <fstream>
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -39,6 +42,19 @@ versvector get_sync_vector (sqlite3 *db);
  */
 sqlite3 *dbopen (const char *path, bool exclusive = false);
 
+/** How SQLite is tuned for a phase of work.  Both keep the database
+ *  in write-ahead-log mode, which dbopen sets up. */
+enum class db_profile {
+  interactive,		///< Ordinary syncs: every commit durable
+  bulk,			///< Initial scans: big cache, mmap, fewer fsyncs
+};
+
+/** Switch db to a tuning profile.  The synchronous level can only be
+ *  changed outside a transaction, so it is left alone inside one.
+ *  Leaving the bulk profile checkpoints the log, so that everything
+ *  committed under it is on disk before any of it reaches a peer. */
+void set_db_profile (sqlite3 *db, db_profile p);
+
 /** Retrieve a configuration value from the database.
  *
  *  Example: `getconfig<i64>(db, "key")`
@@ -58,6 +74,10 @@ setconfig (sqlite3 *db, const string &key, const T &value)
   sqlstmt_t(db, query).param(key, value).step();
 }
 
+/** The key by which state.db indexes message IDs.  Distinct IDs may
+ *  collide, so lookups must still compare the ID itself. */
+i64 msgid_fp (const string &message_id);
+
 /** Structure representing all occurences of a file with a particular
  *  content hash in the maildir. */
 struct hash_info {
@@ -66,18 +86,25 @@ struct hash_info {
   string message_id;
   writestamp hash_stamp = {0, 0};
   std::unordered_map<string,i64> dirs;
+  /** Link counts by local dir_docid.  hash_lookup fills in both this
+   *  and dirs.  Records read through a codec that resolves directories
+   *  put every directory it could resolve here instead of in dirs. */
+  std::unordered_map<i64,i64> dir_docids;
 };
 
 /** Pre-formatted queries for looking up ::hash_info structures in
  *  database. */
 class hash_lookup {
-  sqlstmt_t gethash_;
-  sqlstmt_t getlinks_;
+  typed_stmt<sqlparams<sqlbytes>,
+	     sqlcolumns<i64, i64, sqlbytes, i64, i64>> gethash_;
+  typed_stmt<sqlparams<i64>,
+	     sqlcolumns<sqlbytes, sqlbytes, i64, i64>> getlinks_;
   sqlstmt_t makehash_;
   bool ok_ = false;
   hash_info hi_;
   i64 hash_id_;
   std::vector<std::pair<string,string>> links_;
+  std::vector<i64> link_dirs_;
   std::ifstream content_;
   i64 docid_;
 public:
@@ -93,6 +120,8 @@ public:
     assert (ok());
     return links_;
   }
+  /** The dir_docid of links().at(i) */
+  i64 link_dir_docid(int i) const { return link_dirs_.at(i); }
   i64 docid() const { assert (nlinks()); return docid_; }
   int nlinks() const { return links().size(); }
   string link_path(int i) const {
@@ -103,6 +132,57 @@ public:
   std::streambuf *content();
 };
 
+/** Tags are interned in the tag_names table, and referred to
+ *  everywhere else by the ID it assigns them. */
+using tag_id = i64;
+
+/** (Re)load the in-memory copy of the tag_names table of db, which
+ *  intern_tag() then extends.  Each connection has its own copy,
+ *  freed when it is closed.  Reload after rolling back a transaction
+ *  or savepoint that may have interned tags.  This also makes db the
+ *  database of the overloads below that take none. */
+void load_tag_names (sqlite3 *db);
+/** Return the ID of a tag in db, adding it to tag_names if it is new. */
+tag_id intern_tag (sqlite3 *db, const string &name);
+/** Return the name of a tag interned in db. */
+const string &tag_name (sqlite3 *db, tag_id id);
+/** As above, for the database last passed to load_tag_names(), which
+ *  is what ::tag_info streams and ::record_parser use. */
+tag_id intern_tag (const string &name);
+const string &tag_name (tag_id id);
+
+/** A set of tags, as a sorted vector of ::tag_id.  Messages carry a
+ *  handful of tags, so this beats a hash table of strings. */
+class tag_set {
+  std::vector<tag_id> ids_;
+public:
+  using const_iterator = std::vector<tag_id>::const_iterator;
+  const_iterator begin() const { return ids_.begin(); }
+  const_iterator end() const { return ids_.end(); }
+  size_t size() const { return ids_.size(); }
+  bool empty() const { return ids_.empty(); }
+  void clear() { ids_.clear(); }
+  bool count(tag_id id) const {
+    return std::binary_search(ids_.begin(), ids_.end(), id);
+  }
+  void insert(tag_id id) {
+    auto i = std::lower_bound(ids_.begin(), ids_.end(), id);
+    if (i == ids_.end() || *i != id)
+      ids_.insert(i, id);
+  }
+  void erase(tag_id id) {
+    auto i = std::lower_bound(ids_.begin(), ids_.end(), id);
+    if (i != ids_.end() && *i == id)
+      ids_.erase(i);
+  }
+  /** The names of the tags in db, e.g., to hand to notmuch. */
+  std::unordered_set<string> names(sqlite3 *db) const;
+  /** The names of the tags in the database last loaded. */
+  std::unordered_set<string> names() const;
+  bool operator==(const tag_set &other) const { return ids_ == other.ids_; }
+  bool operator!=(const tag_set &other) const { return ids_ != other.ids_; }
+};
+
 /** Structure representing all the tags associated with a particular
  *  message ID in the database.
  *
@@ -111,14 +191,72 @@ public:
 struct tag_info {
   string message_id;
   writestamp tag_stamp = {0, 0};
-  std::unordered_set<string> tags;
+  tag_set tags;
+};
+
+/** The directories of xapian_dirs by path and by dir_docid, read in
+ *  as needed. */
+class dir_table {
+  sqlite3 *db_ = nullptr;
+  std::unordered_map<string,i64> ids_;
+  std::unordered_map<i64,string> paths_;
+  i64 unknown_ = 0;
+public:
+  /** Look directories up in db from now on. */
+  void load(sqlite3 *db);
+  /** The dir_docid of path, or if xapian_dirs does not have it, a
+   *  negative number that stands for it from now on. */
+  i64 id(const string &path);
+  /** The path of id, or nullptr if unknown. */
+  const string *path(i64 id);
 };
 
+/** Per-connection state for abbreviating records on the wire.
+ *
+ *  A codec attached to a stream with set_wire_codec() changes how
+ *  records are written to it.  With tags set, ::tag_info records take
+ *  the form `t <msgid> R<r>=<v> (<id>[=<name>] ...)`.  With dirs
+ *  set, ::hash_info records take the form `l <hash> <size> <msgid>
+ *  R<r>=<v> (<count>*<id>[=<dir>] ...)`.  In both, the name follows
+ *  an ID only the first time the ID is written to that stream.  Tag
+ *  IDs are those of tag_names, and directory IDs those of local_dirs,
+ *  i.e., dir_docids.  The change journal keeps `l` records in this
+ *  form too, without any names, so that put_journal_link() can send
+ *  them on as they are.
+ *
+ *  Reading `t` or `l` records requires a codec on the input stream,
+ *  which learns the peer's IDs as they are announced.  With
+ *  resolve_dir set, it also maps each directory ID to the local
+ *  dir_docid once, so the records it reads carry those.  The plain
+ *  `T` and `L` forms, which spell out every name, are written to
+ *  streams without a codec and always accepted.
+ */
+struct wire_codec {
+  bool tags = false;
+  bool dirs = false;
+  std::unordered_set<tag_id> tags_sent;
+  std::unordered_map<i64,tag_id> peer_tags;
+  std::shared_ptr<dir_table> local_dirs = std::make_shared<dir_table>();
+  std::unordered_set<i64> dirs_sent;
+  /** Read IDs as those of local_dirs, as in change_journal */
+  bool local_ids = false;
+  std::unordered_map<i64,string> peer_dirs;
+  /** The local dir_docid of a directory the peer named, or -1 to keep
+   *  the path */
+  std::function<i64(const string &)> resolve_dir;
+  /** If set, changes whenever resolve_dir may change its answers */
+  const unsigned *resolve_epoch = nullptr;
+  unsigned peer_dir_epoch = 0;
+  std::unordered_map<i64,i64> peer_dir_docids;
+};
+void set_wire_codec (std::ios_base &s, wire_codec *codec);
+wire_codec *get_wire_codec (std::ios_base &s);
+
 /** Pre-formatted queries for looking up ::tag_info structures in
  *  database. */
 class tag_lookup {
-  sqlstmt_t getmsg_;
-  sqlstmt_t gettags_;
+  typed_stmt<sqlparams<i64, string>, sqlcolumns<i64, i64, i64>> getmsg_;
+  typed_stmt<sqlparams<i64>, sqlcolumns<i64>> gettags_;
   bool ok_ = false;
   tag_info ti_;
   i64 docid_;
@@ -135,8 +273,57 @@ std::istream &operator>> (std::istream &is, hash_info &hi);
 std::ostream &operator<< (std::ostream &os, const tag_info &ti);
 std::istream &operator>> (std::istream &is, tag_info &ti);
 
-string trashname (const string &maildir, const string &hash);
+/** Rewrite the change_journal entries of every hash and message
+ *  listed in journal_dirty, within a savepoint.  Call before reading
+ *  the journal. */
+void flush_journal (sqlite3 *db);
+
+/** A codec for reading the `l` records of the change journal of db,
+ *  sharing dirs if given. */
+wire_codec journal_codec (sqlite3 *db,
+			  std::shared_ptr<dir_table> dirs = nullptr);
+/** Write a link record of change_journal to os, in the form the codec
+ *  of os wants: for a codec with dirs, as it is, but for the names of
+ *  the directories new to os, and otherwise as an `L` record.  journal
+ *  is a journal_codec(). */
+void put_journal_link (std::ostream &os, const string &rec,
+		       wire_codec &journal);
 
-string permissive_percent_encode (const string &raw);
+/** \brief Parses ::hash_info and ::tag_info records out of a line
+ *  without going through iostreams.
+ *
+ *  Accepts exactly what operator>> does, including the abbreviated
+ *  forms if constructed with a ::wire_codec.  Records are decoded in
+ *  place, assigning into the existing strings and ::tag_set of the
+ *  record passed in, so a loop parsing into the same objects stops
+ *  allocating once they have grown (except for the nodes of
+ *  hash_info::dirs).  After a failed parse, the record is left
+ *  half-written.
+ */
+class record_parser {
+  const char *p_ = nullptr;
+  const char *end_ = nullptr;
+  wire_codec *codec_;
+  string field_;
+
+  void skip_space();
+  bool next_char(char *c);
+  bool match(char want);
+  bool token(const char **s, size_t *n);
+  bool list_item(const char **s, size_t *n);
+  bool number(i64 *v);
+  bool stamp(writestamp *ws);
+  template<typename F> bool list(F &&item);
+public:
+  explicit record_parser(wire_codec *codec = nullptr) : codec_(codec) {}
+  /** Start parsing at offset pos of line, which must outlive the
+   *  parse calls. */
+  record_parser &reset(const string &line, size_t pos = 0);
+  bool parse(hash_info &hi);
+  bool parse(tag_info &ti);
+  bool parse(i64 &n) { return number(&n); }
+};
+
+string trashname (const string &maildir, const string &hash);
 
 #endif /* !_SQL_DB_H */
@@ -1,8 +1,10 @@
 
 #include <cassert>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <sstream>
+#include <unordered_map>
 
 #include <stdio.h>
 #include <stdint.h>
@@ -71,6 +73,74 @@ sqlstmt_t::sqlstmt_t (sqlite3 *db, const char *fmt, ...)
     throw sqlerr_t (string("illegal compound query\n  Query:  ") + query);
 }
 
+namespace {
+/* Free prepared statements of one connection, most recently used
+ * first, and indexed by their SQL text. */
+struct stmt_cache {
+  static constexpr size_t capacity = 64;
+  using entry = pair<string, sqlite3_stmt *>;
+  list<entry> lru;
+  unordered_multimap<string, list<entry>::iterator> index;
+  ~stmt_cache() {
+    for (entry &e : lru)
+      sqlite3_finalize (e.second);
+  }
+};
+unordered_map<sqlite3 *, stmt_cache> stmt_caches;
+}
+
+sqlstmt_t
+sqlstmt_t::cached (sqlite3 *db, const char *sql)
+{
+  stmt_cache &c = stmt_caches[db];
+  sqlite3_stmt *stmt;
+  auto i = c.index.find (sql);
+  if (i != c.index.end()) {
+    stmt = i->second->second;
+    c.lru.erase (i->second);
+    c.index.erase (i);
+  }
+  else {
+    const char *tail;
+    if (sqlite3_prepare_v2 (db, sql, -1, &stmt, &tail))
+      dbthrow (db, sql);
+    if (tail && *tail) {
+      sqlite3_finalize (stmt);
+      throw sqlerr_t (string("illegal compound query\n  Query:  ") + sql);
+    }
+  }
+  sqlstmt_t s (stmt);
+  s.cached_ = true;
+  return s;
+}
+
+void
+sqlstmt_t::give_back ()
+{
+  auto ci = stmt_caches.find (sqlite3_db_handle (stmt_));
+  if (ci == stmt_caches.end()) {
+    // Connection closed by sqlclose while we were checked out
+    sqlite3_finalize (stmt_);
+    return;
+  }
+  stmt_cache &c = ci->second;
+  sqlite3_reset (stmt_);
+  sqlite3_clear_bindings (stmt_);
+  c.lru.emplace_front (sqlite3_sql (stmt_), stmt_);
+  c.index.emplace (c.lru.front().first, c.lru.begin());
+  if (c.lru.size() > stmt_cache::capacity) {
+    auto last = prev (c.lru.end());
+    auto r = c.index.equal_range (last->first);
+    for (auto j = r.first; j != r.second; ++j)
+      if (j->second == last) {
+	c.index.erase (j);
+	break;
+      }
+    sqlite3_finalize (last->second);
+    c.lru.pop_back();
+  }
+}
+
 sqlstmt_t::sqlstmt_t(const sqlstmt_t &l)
 {
   int err = sqlite3_prepare_v2(sqlite3_db_handle(l.stmt_),
@@ -96,3 +166,10 @@ sqlexec (sqlite3 *db, const char *fmt, ...)
   if (err != SQLITE_OK && err != SQLITE_DONE && err != SQLITE_ROW)
     dbthrow (db, query);
 }
+
+void
+sqlclose (sqlite3 *db)
+{
+  stmt_caches.erase (db);
+  sqlite3_close_v2 (db);
+}
@@ -3,10 +3,13 @@
 #ifndef _SQLSTMT_H_
 #define _SQLSTMT_H_ 1
 
+#include <algorithm>
 #include <cassert>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <stdexcept>
+#include <vector>
 #include <sqlite3.h>
 
 using i64 = sqlite3_int64;
@@ -19,10 +22,25 @@ struct sqldone_t : public std::runtime_error {
   sqldone_t (const std::string &msg) : std::runtime_error (msg) {}
 };
 
+/** A TEXT or BLOB column read in place.  The data belongs to the
+ *  statement, and is only valid until it is next stepped or reset.
+ *  As a parameter, binds a BLOB. */
+struct sqlbytes {
+  const char *data = nullptr;
+  size_t size = 0;
+  sqlbytes() = default;
+  sqlbytes(const char *d, size_t n) : data(d), size(n) {}
+  explicit sqlbytes(const std::string &s) : data(s.data()), size(s.size()) {}
+  std::string str() const { return { data, size }; }
+  void assign_to(std::string *s) const { s->assign(data, size); }
+};
+
 class sqlstmt_t {
   sqlite3_stmt *stmt_;
   int status_ = SQLITE_OK;
+  bool cached_ = false;		// Give stmt_ back to the cache when done
   sqlstmt_t &set_status (int status);
+  void give_back ();
   void fail ();
   void ensure_row () { if (status_ != SQLITE_ROW) fail(); }
 
@@ -30,8 +48,23 @@ class sqlstmt_t {
   explicit sqlstmt_t(sqlite3_stmt *stmt) : stmt_(stmt) {}
   explicit sqlstmt_t(sqlite3 *db, const char *fmt, ...);
   sqlstmt_t(const sqlstmt_t &r);
-  sqlstmt_t(sqlstmt_t &&r) : stmt_ (r.stmt_) { r.stmt_ = nullptr; }
-  ~sqlstmt_t() { sqlite3_finalize (stmt_); }
+  sqlstmt_t(sqlstmt_t &&r) : stmt_ (r.stmt_), cached_ (r.cached_) {
+    r.stmt_ = nullptr;
+    r.cached_ = false;
+  }
+  ~sqlstmt_t() {
+    if (cached_)
+      give_back();
+    else
+      sqlite3_finalize (stmt_);
+  }
+
+  /** Take a statement for sql out of the cache of db, or prepare one
+   *  if there is none free.  It goes back into the cache, reset and
+   *  with its bindings cleared, when destroyed.  Unlike with the
+   *  constructor, sql is not a format: bind parameters instead, so
+   *  that the text, and hence the cached statement, can be reused. */
+  static sqlstmt_t cached(sqlite3 *db, const char *sql);
 
   sqlite3_stmt *get() { return stmt_; }
   sqlite3 *getdb() { return sqlite3_db_handle(stmt_); }
@@ -113,6 +146,9 @@ class sqlstmt_t {
   sqlstmt_t &bind(int i, std::string &&v) { return bind_text(i, std::move(v)); }
   sqlstmt_t &bind(int i, const char *v) { return bind_text(i, v); }
   sqlstmt_t &bind(int i, const sqlite3_value *v) { return bind_value(i, v); }
+  sqlstmt_t &bind(int i, const sqlbytes &v) {
+    return bind_blob(i, v.data, v.size);
+  }
 
   /* Bind multiple parameters at once */
   sqlstmt_t &_param(int) { return *this; }
@@ -168,6 +204,236 @@ sqlstmt_t::column(int i)
   return c_str(i);
 }
 
+/* Column access for typed_stmt, without the checks of sqlstmt_t */
+template<typename T> struct sqlcolumn;
+template<> struct sqlcolumn<i64> {
+  static i64 get(sqlite3_stmt *s, int i) { return sqlite3_column_int64(s, i); }
+};
+template<> struct sqlcolumn<double> {
+  static double get(sqlite3_stmt *s, int i) {
+    return sqlite3_column_double(s, i);
+  }
+};
+template<> struct sqlcolumn<sqlbytes> {
+  static sqlbytes get(sqlite3_stmt *s, int i) {
+    // Blob before bytes, so the length is that of what we point to
+    const char *p = static_cast<const char *> (sqlite3_column_blob(s, i));
+    return { p, size_t (sqlite3_column_bytes(s, i)) };
+  }
+};
+template<> struct sqlcolumn<std::string> {
+  static std::string get(sqlite3_stmt *s, int i) {
+    return sqlcolumn<sqlbytes>::get(s, i).str();
+  }
+};
+
+template<size_t N> struct sqlrow_fill {
+  template<typename Row> static void go(sqlite3_stmt *s, Row &r) {
+    sqlrow_fill<N-1>::go(s, r);
+    using T = typename std::tuple_element<N-1,Row>::type;
+    std::get<N-1>(r) = sqlcolumn<T>::get(s, N-1);
+  }
+};
+template<> struct sqlrow_fill<0> {
+  template<typename Row> static void go(sqlite3_stmt *, Row &) {}
+};
+
+template<typename... T> struct sqlparams {};
+template<typename... T> struct sqlcolumns {};
+template<typename P, typename C> class typed_stmt;
+
+/** \brief A statement whose parameter and column types are part of
+ *  its type.
+ *
+ *  Example:
+ *
+ *      typed_stmt<sqlparams<i64>, sqlcolumns<sqlbytes, i64>>
+ *        q (db, "SELECT name, size FROM t WHERE id = ?;");
+ *      for (const auto &r : q.run(id))
+ *        use (std::get<0>(r), std::get<1>(r));
+ *
+ *  The constructor checks the counts against the SQL.  Whether there
+ *  is a row is checked once per step; the accessors then read the
+ *  columns directly.
+ */
+template<typename... P, typename... C>
+class typed_stmt<sqlparams<P...>, sqlcolumns<C...>> {
+  sqlstmt_t s_;
+  bool row_ = false;
+  void check() {
+    if (sqlite3_bind_parameter_count(s_.get()) != int(sizeof...(P))
+	|| sqlite3_column_count(s_.get()) != int(sizeof...(C)))
+      throw sqlerr_t (std::string ("typed_stmt: wrong parameter or column"
+				   " count\n  Query: ") + sqlite3_sql(s_.get()));
+  }
+public:
+  using row_type = std::tuple<C...>;
+
+  template<typename... A>
+  explicit typed_stmt(sqlite3 *db, const char *fmt, A... a)
+    : s_(db, fmt, a...) { check(); }
+  /** E.g., from sqlstmt_t::cached */
+  explicit typed_stmt(sqlstmt_t &&s) : s_(std::move(s)) { check(); }
+
+  /** Bind the parameters and step to the first row, if any. */
+  typed_stmt &run(const P&... p) {
+    s_.reset().param(p...);
+    return step();
+  }
+  typed_stmt &step() {
+    row_ = s_.step().status() == SQLITE_ROW;
+    return *this;
+  }
+  /** Let go of the current row, e.g., so as not to hold a read lock. */
+  typed_stmt &reset() {
+    s_.reset();
+    row_ = false;
+    return *this;
+  }
+  bool row() const { return row_; }
+
+  template<size_t I> typename std::tuple_element<I,row_type>::type
+  get() {
+    assert (row_);
+    return sqlcolumn<typename std::tuple_element<I,row_type>::type>
+      ::get(s_.get(), I);
+  }
+  row_type fetch() {
+    assert (row_);
+    row_type r;
+    sqlrow_fill<sizeof...(C)>::go(s_.get(), r);
+    return r;
+  }
+
+  /** Iterates over the remaining rows, stepping the statement. */
+  class iterator {
+    typed_stmt *q_;
+    row_type r_;
+  public:
+    explicit iterator(typed_stmt *q) : q_(q && q->row() ? q : nullptr) {
+      if (q_)
+	r_ = q_->fetch();
+    }
+    const row_type &operator*() const { return r_; }
+    const row_type *operator->() const { return &r_; }
+    iterator &operator++() {
+      if (q_->step().row())
+	r_ = q_->fetch();
+      else
+	q_ = nullptr;
+      return *this;
+    }
+    bool operator!=(const iterator &o) const { return q_ != o.q_; }
+  };
+  iterator begin() { return iterator(this); }
+  iterator end() { return iterator(nullptr); }
+
+  sqlstmt_t &stmt() { return s_; }
+};
+
+template<size_t N> struct sqlrow_bind {
+  template<typename Row> static void go(sqlstmt_t &s, int i, const Row &r) {
+    sqlrow_bind<N-1>::go(s, i, r);
+    s.bind(i + N - 1, std::get<N-1>(r));
+  }
+};
+template<> struct sqlrow_bind<0> {
+  template<typename Row> static void go(sqlstmt_t &, int, const Row &) {}
+};
+
+/** \brief Gathers rows for an INSERT, and writes them in batches of
+ *  multi-row INSERTs, so that SQLite runs one statement per batch
+ *  rather than per row.
+ *
+ *  Example:
+ *
+ *      sqlbulk<i64, string> ins (db, "INSERT INTO t (id, name, new)",
+ *                                "(?, ?, 1)");
+ *      for (...)
+ *        ins.add(id, name);
+ *      ins.flush();
+ *
+ *  The row SQL must have one parameter per T.  Rows reach the
+ *  database in the order added, but only by the time flush()
+ *  returns, so flush before anything that reads the table, or the
+ *  tables its triggers write.  Rows not flushed are dropped.
+ */
+template<typename... T> class sqlbulk {
+  static_assert(sizeof...(T) > 0, "sqlbulk needs at least one column");
+  sqlite3 *db_;
+  std::string head_;
+  std::string row_;
+  size_t batch_;
+  std::unique_ptr<sqlstmt_t> full_;	// INSERT of batch_ rows
+  std::vector<std::tuple<T...>> rows_;
+
+  std::string sql(size_t nrows) const {
+    std::string ret = head_ + " VALUES ";
+    for (size_t i = 0; i < nrows; i++) {
+      if (i)
+	ret += ", ";
+      ret += row_;
+    }
+    return ret + ";";
+  }
+  void write(sqlstmt_t &s, size_t first, size_t nrows) {
+    if (sqlite3_bind_parameter_count(s.get()) != int(nrows * sizeof...(T)))
+      throw sqlerr_t ("sqlbulk: wrong parameter count\n  Query: " + sql(1));
+    for (size_t i = 0; i < nrows; i++)
+      sqlrow_bind<sizeof...(T)>::go(s, 1 + i * sizeof...(T),
+				     rows_[first + i]);
+    s.step();
+  }
+public:
+  /** head is the INSERT up to VALUES, and row the SQL for one row,
+   *  by default a parameter per column.  A batch has at most batch
+   *  rows, and no more parameters than SQLite allows. */
+  sqlbulk(sqlite3 *db, std::string head, std::string row = "",
+	  size_t batch = 256)
+    : db_(db), head_(std::move(head)), row_(std::move(row)),
+      batch_(std::max<size_t>
+	     (1, std::min<size_t> (batch, sqlite3_limit
+				   (db, SQLITE_LIMIT_VARIABLE_NUMBER, -1)
+				   / sizeof...(T)))) {
+    if (row_.empty()) {
+      row_ = "(?";
+      for (size_t i = 1; i < sizeof...(T); i++)
+	row_ += ", ?";
+      row_ += ")";
+    }
+    rows_.reserve(batch_);
+  }
+  void add(T... t) {
+    rows_.emplace_back(std::move(t)...);
+    if (rows_.size() >= batch_)
+      flush();
+  }
+  void flush() {
+    size_t i = 0, n = rows_.size();
+    if (n >= batch_ && !full_)
+      full_.reset(new sqlstmt_t (db_, "%s", sql(batch_).c_str()));
+    for (; n - i >= batch_; i += batch_)
+      write(full_->reset(), i, batch_);
+    if (i < n) {
+      sqlstmt_t rest (db_, "%s", sql(n - i).c_str());
+      write(rest, i, n - i);
+    }
+    rows_.clear();
+  }
+  size_t pending() const { return rows_.size(); }
+};
+
 void sqlexec (sqlite3 *db, const char *fmt, ...);
 
+/** Run a single statement through the statement cache of db, with
+ *  args bound to its parameters.  For statements run often. */
+template<typename... Args> inline void
+sqlexec_cached (sqlite3 *db, const char *sql, Args&&... args)
+{
+  sqlstmt_t::cached(db, sql).param(std::forward<Args>(args)...).step();
+}
+
+/** Close db, after dropping its statement cache. */
+void sqlclose (sqlite3 *db);
+
 #endif /* !_SQLSTMT_H_ */
@@ -0,0 +1,71 @@
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <dirent.h>
+#include <unistd.h>
+#include "check.h"
+
+using namespace std;
+
+// Globals the library code expects muchsync.cc to define
+int opt_verbose;
+extern const char muchsync_trashdir[];
+const char muchsync_trashdir[] = ".notmuch/muchsync/trash";
+
+bool bench;
+
+static string scratch;
+static int failures;
+
+void
+check_init (int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp (argv[i], "--bench"))
+      bench = true;
+    else {
+      cerr << "usage: " << argv[0] << " [--bench]\n";
+      exit (2);
+    }
+  }
+  const char *tmp = getenv ("TMPDIR");
+  string templ = string (tmp && *tmp ? tmp : "/tmp") + "/muchsync-check-XXXXXX";
+  if (!mkdtemp (&templ[0])) {
+    perror (templ.c_str());
+    exit (2);
+  }
+  scratch = templ;
+}
+
+string
+scratch_path (const string &name)
+{
+  return scratch + "/" + name;
+}
+
+bool
+check_that (bool ok, const char *what, const char *file, int line)
+{
+  if (!ok && failures++ < 20)
+    cerr << file << ':' << line << ": check failed: " << what << '\n';
+  return ok;
+}
+
+int
+check_result ()
+{
+  if (DIR *d = opendir (scratch.c_str())) {
+    while (dirent *e = readdir (d))
+      if (strcmp (e->d_name, ".") && strcmp (e->d_name, ".."))
+	unlink (scratch_path (e->d_name).c_str());
+    closedir (d);
+  }
+  rmdir (scratch.c_str());
+  if (failures) {
+    cerr << failures << " check(s) failed\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+// -*- C++ -*-
+
+#ifndef _MUCHSYNC_CHECK_H_
+#define _MUCHSYNC_CHECK_H_ 1
+
+/** \file check.h
+ *  \brief Helpers shared by the programs that `make check` and `make
+ *  bench` run.
+ *
+ *  Each program compares an optimized routine against a reference
+ *  (the code it replaced, or the straightforward way of doing the
+ *  same thing) and exits non-zero on any difference.  Run with
+ *  `--bench`, it uses the sizes quoted in the commit log and also
+ *  prints timings.
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using std::string;
+
+/** Set by check_init() if the program was run with `--bench`. */
+extern bool bench;
+
+/** Parse the command line, and create a scratch directory that
+ *  check_result() removes again. */
+void check_init (int argc, char **argv);
+/** A path in the scratch directory. */
+string scratch_path (const string &name);
+/** Print a summary, clean up, and return the exit status for main. */
+int check_result ();
+
+/** Record a failure unless cond holds. */
+#define CHECK(cond) check_that ((cond), #cond, __FILE__, __LINE__)
+bool check_that (bool ok, const char *what, const char *file, int line);
+
+/** Pick the size for a check or a benchmark run. */
+template<typename T> inline T
+check_size (T small, T large)
+{
+  return bench ? large : small;
+}
+
+inline double
+now ()
+{
+  using namespace std::chrono;
+  return duration<double> (steady_clock::now().time_since_epoch()).count();
+}
+
+/** The fastest of n runs of f, in seconds. */
+template<typename F> double
+best_of (int n, F &&f)
+{
+  double best = 1e300;
+  for (int i = 0; i < n; i++) {
+    double start = now();
+    f();
+    double t = now() - start;
+    if (t < best)
+      best = t;
+  }
+  return best;
+}
+
+#endif /* !_MUCHSYNC_CHECK_H_ */
@@ -0,0 +1,154 @@
+
+/* message_ids indexed by msgid_fp, with msg_sync checking for an ID
+ * before recording it, against the UNIQUE index on the text that
+ * muchsync 1 used: the same IDs must end up under the same docids,
+ * and be found the same way. */
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "check.h"
+#include "sql_db.h"
+
+using namespace std;
+
+/* message_ids as in muchsync 1, and as in muchsync_schema now */
+static const char old_schema[] = R"(
+CREATE TABLE message_ids (
+  message_id TEXT UNIQUE NOT NULL,
+  docid INTEGER PRIMARY KEY,
+  replica INTEGER,
+  version INTEGER);)";
+static const char new_schema[] = R"(
+CREATE TABLE message_ids (
+  message_id TEXT NOT NULL,
+  msgid_fp INTEGER NOT NULL,
+  docid INTEGER PRIMARY KEY,
+  replica INTEGER,
+  version INTEGER);
+CREATE INDEX message_ids_msgid_fp ON message_ids (msgid_fp);)";
+
+/* msg_sync's record_docid_, before and after */
+static const char old_insert[] =
+  "INSERT OR IGNORE INTO message_ids (message_id, docid, replica, version)"
+  " VALUES (?, ?, 0, 0);";
+static const char new_insert[] =
+  "INSERT OR IGNORE INTO message_ids"
+  " (message_id, msgid_fp, docid, replica, version)"
+  " SELECT ?1, ?2, ?3, 0, 0 WHERE NOT EXISTS"
+  " (SELECT 1 FROM message_ids WHERE msgid_fp = ?2 AND message_id = ?1);";
+
+/* tag_lookup's query, before and after */
+static const char old_lookup[] =
+  "SELECT docid, replica, version FROM message_ids WHERE message_id = ?;";
+static const char new_lookup[] =
+  "SELECT docid, replica, version"
+  " FROM message_ids WHERE msgid_fp = ? AND message_id = ?;";
+
+struct variant {
+  const char *name;
+  bool fp;
+  sqlite3 *db = nullptr;
+  double insert_time = 0;
+
+  variant (const char *n, bool f) : name (n), fp (f) {}
+  void open (const string &path) {
+    CHECK (sqlite3_open (path.c_str(), &db) == SQLITE_OK);
+    sqlexec (db, "PRAGMA journal_mode = WAL;");
+    sqlexec (db, fp ? new_schema : old_schema);
+  }
+  void insert (const vector<string> &ids, i64 first_docid) {
+    sqlstmt_t s (db, "%s", fp ? new_insert : old_insert);
+    double t = now();
+    sqlexec (db, "BEGIN;");
+    for (size_t i = 0; i < ids.size(); i++)
+      if (fp)
+	s.reset().param(ids[i], msgid_fp(ids[i]), first_docid + i64(i)).step();
+      else
+	s.reset().param(ids[i], first_docid + i64(i)).step();
+    sqlexec (db, "COMMIT;");
+    insert_time += now() - t;
+  }
+  /* The docid of each ID, or -1 */
+  vector<i64> lookup (const vector<string> &ids) {
+    vector<i64> ret;
+    sqlstmt_t s (db, "%s", fp ? new_lookup : old_lookup);
+    for (const string &id : ids) {
+      if (fp)
+	s.reset().param(msgid_fp(id), id).step();
+      else
+	s.reset().param(id).step();
+      ret.push_back (s.row() ? s.integer(0) : -1);
+    }
+    return ret;
+  }
+  vector<pair<string,i64>> rows () {
+    vector<pair<string,i64>> ret;
+    sqlstmt_t s (db, "SELECT message_id, docid FROM message_ids"
+		 " ORDER BY docid;");
+    while (s.step().row())
+      ret.emplace_back (s.str(0), s.integer(1));
+    return ret;
+  }
+  double file_mib () {
+    return sqlstmt_t (db, "PRAGMA page_count;").step().integer(0)
+      * sqlstmt_t (db, "PRAGMA page_size;").step().integer(0) / 1048576.0;
+  }
+};
+
+static vector<string>
+make_ids (int n)
+{
+  mt19937_64 rng (1);
+  vector<string> ids;
+  for (int i = 0; i < n; i++) {
+    char buf[128];
+    snprintf (buf, sizeof buf, "%08llx.%06d.%016llx@mail%d.example.org",
+	      (unsigned long long) (rng() >> 32), i,
+	      (unsigned long long) rng(), int (rng() % 50));
+    ids.push_back (buf);
+  }
+  return ids;
+}
+
+int
+main (int argc, char **argv)
+{
+  check_init (argc, argv);
+  int n = check_size (5000, 200000);
+  vector<string> ids = make_ids (n);
+  // Every tenth ID again, as when notmuch reports a known ID as new
+  vector<string> again;
+  for (int i = 0; i < n; i += 10)
+    again.push_back (ids[i]);
+  vector<string> probes = ids;
+  shuffle (probes.begin(), probes.end(), mt19937_64 (2));
+  probes.push_back ("<not-there@example.org>");
+
+  variant v[] = { { "text UNIQUE (muchsync 1)", false },
+		  { "msgid_fp index", true } };
+  vector<i64> found[2];
+  double lookup_time[2];
+  for (int k = 0; k < 2; k++) {
+    v[k].open (scratch_path (to_string (k) + ".db"));
+    v[k].insert (ids, 1);
+    v[k].insert (again, n + 1);
+    sqlexec (v[k].db, "PRAGMA wal_checkpoint(TRUNCATE);");
+    lookup_time[k] = best_of (3, [&]() { found[k] = v[k].lookup (probes); });
+  }
+  CHECK (v[0].rows() == v[1].rows());
+  CHECK (v[1].rows().size() == size_t (n));
+  CHECK (found[0] == found[1]);
+  CHECK (found[1].back() == -1);
+  cout << n << " message IDs recorded and found the same both ways\n";
+
+  if (bench)
+    for (int k = 0; k < 2; k++)
+      printf ("%-26s file %6.1f MiB, insert %5.0f ms, lookup %5.2f us\n",
+	      v[k].name, v[k].file_mib(), v[k].insert_time * 1e3,
+	      lookup_time[k] / probes.size() * 1e6);
+  for (variant &x : v)
+    sqlclose (x.db);
+  return check_result();
+}
@@ -0,0 +1,210 @@
+
+/* record_parser against the istream operator>> for hash_info and
+ * tag_info, on randomly mutated records in both the plain and the
+ * dictionary forms. */
+
+#include <cstdio>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+#include "check.h"
+#include "sql_db.h"
+
+using namespace std;
+
+template<typename R> static string
+show (bool ok, const R &r)
+{
+  if (!ok)
+    return "FAIL";
+  ostringstream os;
+  os << r;
+  return os.str();
+}
+
+/* Teach a codec the IDs the seed records below refer to. */
+static void
+prime (wire_codec &codec)
+{
+  hash_info hi;
+  tag_info ti;
+  istringstream l ("l 00112233445566778899aabbccddeeff00112233 1 m R1=1"
+		   " (1*0=x/cur 1*1=y)");
+  set_wire_codec (l, &codec);
+  l >> hi;
+  istringstream t ("t m R1=1 (1=inbox 2=u)");
+  set_wire_codec (t, &codec);
+  t >> ti;
+}
+
+template<typename R> static string
+via_istream (const string &line, wire_codec &codec)
+{
+  try {
+    istringstream is (line);
+    set_wire_codec (is, &codec);
+    R r;
+    bool ok (is >> r);
+    return show (ok, r);
+  }
+  catch (const exception &e) {
+    return string ("EXC ") + e.what();
+  }
+}
+
+template<typename R> static string
+via_parser (const string &line, wire_codec &codec)
+{
+  try {
+    record_parser rp (&codec);
+    R r;
+    bool ok = rp.reset(line).parse(r);
+    return show (ok, r);
+  }
+  catch (const exception &e) {
+    return string ("EXC ") + e.what();
+  }
+}
+
+template<typename R> static void
+compare (const string &line)
+{
+  wire_codec a, b;
+  prime (a);
+  prime (b);
+  string x = via_istream<R> (line, a), y = via_parser<R> (line, b);
+  if (!CHECK (x == y))
+    cerr << "  [" << line << "]\n  istream: " << x << "\n  parser:  " << y
+	 << '\n';
+}
+
+static void
+equivalence ()
+{
+  static const vector<string> seeds = {
+    "L 00112233445566778899aabbccddeeff00112233 10 m%40x R7=1"
+    " (1*x/cur 2*a%20b/new)",
+    "L 00112233445566778899aabbccddeeff00112233 10 m@x R7=1 ()",
+    "L 00112233445566778899aabbccddeeff00112233 10 m@x R 7 = 1 ( 1 * x ) ",
+    "T m@x R3=4 (inbox unread)",
+    "T m@x R3=4 ()",
+    "T m@x R3=4 ( a b)",
+    "T m R1=2 (x))",
+    "l 00112233445566778899aabbccddeeff00112233 10 m@x R7=1"
+    " (1*0=x/cur 2*1=y)",
+    "l 00112233445566778899aabbccddeeff00112233 10 m@x R7=1 (1*0 2*1)",
+    "t m@x R3=4 (1=inbox 2=u)",
+    "t m@x R3=4 (1 2)",
+    "t m@x R3=4 (9)",
+  };
+  static const string alphabet = " ()*=R%0123456789abLTlt@x";
+  mt19937 rng (1);
+  int rounds = check_size (20000, 200000);
+  for (int round = 0; round < rounds; round++) {
+    string line = seeds[rng() % seeds.size()];
+    for (int m = rng() % 3; m > 0 && !line.empty(); m--) {
+      size_t pos = rng() % line.size();
+      char c = alphabet[rng() % alphabet.size()];
+      switch (rng() % 3) {
+      case 0:
+	line.erase (pos, 1);
+	break;
+      case 1:
+	line.insert (pos, 1, c);
+	break;
+      default:
+	line[pos] = c;
+	break;
+      }
+    }
+    compare<hash_info> (line);
+    compare<tag_info> (line);
+  }
+  cout << 2 * rounds << " mutated records parsed the same both ways\n";
+}
+
+static void
+throughput ()
+{
+  const string links = "L 00112233445566778899aabbccddeeff00112233 12345"
+    " <20200101.abcdef@example.com> R123456789=42 (1*INBOX/cur)";
+  const string tags = "T <20200101.abcdef@example.com> R123456789=42"
+    " (inbox unread attachment)";
+  const int n = 1000000;
+  record_parser rp;
+  hash_info hi;
+  tag_info ti;
+  istringstream is;
+  double lp = best_of (3, [&]() {
+      for (int i = 0; i < n; i++)
+	rp.reset(links).parse(hi);
+    });
+  double li = best_of (3, [&]() {
+      for (int i = 0; i < n; i++) {
+	is.clear();
+	is.str(links);
+	hash_info h;
+	is >> h;
+      }
+    });
+  double tp = best_of (3, [&]() {
+      for (int i = 0; i < n; i++)
+	rp.reset(tags).parse(ti);
+    });
+  double tiu = best_of (3, [&]() {
+      for (int i = 0; i < n; i++) {
+	is.clear();
+	is.str(tags);
+	tag_info t;
+	is >> t;
+      }
+    });
+  printf ("L records: record_parser %.2f M/s, operator>> %.2f M/s\n",
+	  n / lp / 1e6, n / li / 1e6);
+  printf ("T records: record_parser %.2f M/s, operator>> %.2f M/s\n",
+	  n / tp / 1e6, n / tiu / 1e6);
+}
+
+/* The tag records of a replica image reach a new replica before its
+ * state.db exists, so fetch_image keeps them as text and apply_image
+ * reads them once the database is open. */
+static void
+image_tags (const char *dbname)
+{
+  const string rec = "T <a@example.org> R5=17 (inbox unread)";
+  tag_info ti;
+  bool refused = false;
+  try {
+    record_parser().reset(rec).parse(ti);
+  }
+  catch (const logic_error &) {
+    refused = true;
+  }
+  CHECK (refused);
+
+  sqlite3 *db = dbopen (scratch_path (dbname).c_str());
+  if (!CHECK (db))
+    return;
+  CHECK (record_parser().reset(rec).parse(ti));
+  CHECK (ti.message_id == "<a@example.org>" && ti.tag_stamp.second == 17);
+  CHECK (ti.tags.names(db) == unordered_set<string>({"inbox", "unread"}));
+  sqlclose (db);
+}
+
+int
+main (int argc, char **argv)
+{
+  check_init (argc, argv);
+  image_tags ("image.db");
+  // Tag names are interned, so the parsers need a database
+  sqlite3 *db = dbopen (scratch_path ("state.db").c_str());
+  if (!CHECK (db))
+    return check_result();
+  equivalence();
+  if (bench)
+    throughput();
+  sqlclose (db);
+  return check_result();
+}
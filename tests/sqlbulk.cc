@@ -0,0 +1,139 @@
+
+/* sqlbulk against one INSERT per row, as xapian_sync.cc used to add
+ * messages and tags: both must leave the same rows behind, including
+ * those the triggers write. */
+
+#include <cstdio>
+#include <vector>
+#include "check.h"
+#include "sql_db.h"
+
+using namespace std;
+
+using table = vector<vector<string>>;
+
+/* The temporary trigger that xapian_sync.cc sets on tags */
+static const char tag_trigger[] = R"(
+CREATE TEMP TABLE modified_docids (
+  docid INTEGER PRIMARY KEY,
+  new INTEGER);
+CREATE TEMP TRIGGER tag_insert AFTER INSERT ON main.tags
+  WHEN new.docid NOT IN (SELECT docid FROM modified_docids)
+  BEGIN INSERT INTO modified_docids (docid, new) VALUES (new.docid, 0); END;
+)";
+
+static string
+message_id (int i)
+{
+  return "<" + to_string (i64 (i) * 7919) + ".msg@example.org>";
+}
+
+static void
+per_row (sqlite3 *db, int n)
+{
+  sqlstmt_t
+    am (db, "INSERT INTO message_ids (message_id, msgid_fp, docid,"
+	" replica, version) VALUES (?, ?, ?, 1, 2);"),
+    at (db, "INSERT INTO tags (docid, tag_id) VALUES (?, ?);");
+  for (int i = 1; i <= n; i++) {
+    string id = message_id (i);
+    am.reset().param(id, msgid_fp(id), i64(i)).step();
+  }
+  for (int t = 1; t <= 3; t++)
+    for (int i = 1; i <= n; i++)
+      at.reset().param(i64(i), i64(t)).step();
+}
+
+static void
+bulk (sqlite3 *db, int n)
+{
+  sqlbulk<string, i64, i64>
+    am (db, "INSERT INTO message_ids (message_id, msgid_fp, docid,"
+	" replica, version)", "(?, ?, ?, 1, 2)");
+  sqlbulk<i64, i64> at (db, "INSERT INTO tags (docid, tag_id)");
+  for (int i = 1; i <= n; i++) {
+    string id = message_id (i);
+    am.add(id, msgid_fp(id), i);
+  }
+  am.flush();
+  for (int t = 1; t <= 3; t++)
+    for (int i = 1; i <= n; i++)
+      at.add(i, t);
+  at.flush();
+}
+
+static table
+dump (sqlite3 *db, const char *query)
+{
+  table ret;
+  sqlstmt_t s (db, "%s", query);
+  for (s.step(); s.row(); s.step()) {
+    ret.emplace_back();
+    for (int i = 0, n = sqlite3_column_count (s.get()); i < n; i++)
+      ret.back().push_back (s.null(i) ? "NULL" : s.str(i));
+  }
+  return ret;
+}
+
+static const char *const dumps[] = {
+  "SELECT * FROM message_ids ORDER BY docid;",
+  "SELECT * FROM tags ORDER BY docid, tag_id;",
+  "SELECT * FROM modified_docids ORDER BY docid;",
+  "SELECT * FROM journal_dirty ORDER BY 1, 2;",
+  "SELECT * FROM replicas ORDER BY replica;",
+};
+
+/* Fill a fresh database one way, and return how long it took. */
+static double
+load (const string &name, int n, void (*fill) (sqlite3 *, int),
+      vector<table> *out)
+{
+  sqlite3 *db = dbopen (scratch_path (name).c_str());
+  if (!CHECK (db))
+    return 0;
+  sqlexec (db, tag_trigger);
+  sqlexec (db, "BEGIN;");
+  double t = now();
+  fill (db, n);
+  t = now() - t;
+  if (out)
+    for (const char *q : dumps)
+      out->push_back (dump (db, q));
+  sqlexec (db, "COMMIT;");
+  sqlclose (db);
+  return t;
+}
+
+static void
+equivalence (int n)
+{
+  vector<table> a, b;
+  load ("row.db", n, per_row, &a);
+  load ("bulk.db", n, bulk, &b);
+  CHECK (a.size() == sizeof (dumps) / sizeof (dumps[0]));
+  CHECK (a[0].size() == size_t (n) && a[1].size() == size_t (3 * n));
+  for (size_t i = 0; i < a.size() && i < b.size(); i++)
+    if (!CHECK (a[i] == b[i]))
+      cerr << "  differs: " << dumps[i] << '\n';
+  cout << 4 * n << " rows inserted the same both ways\n";
+}
+
+static void
+throughput (int n)
+{
+  double r = load ("row-bench.db", n, per_row, nullptr),
+    b = load ("bulk-bench.db", n, bulk, nullptr);
+  printf ("%d messages, %d tags: one INSERT per row %.2f s (%.0f ns/row),"
+	  " sqlbulk %.2f s (%.0f ns/row)\n", n, 3 * n, r, r / (4.0 * n) * 1e9,
+	  b, b / (4.0 * n) * 1e9);
+}
+
+int
+main (int argc, char **argv)
+{
+  check_init (argc, argv);
+  equivalence (check_size (20000, 200000));
+  if (bench)
+    throughput (1000000);
+  return check_result();
+}
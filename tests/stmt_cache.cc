@@ -0,0 +1,98 @@
+
+/* sqlstmt_t::cached and sqlexec_cached: the cache hands statements
+ * back out only once they are released, and a cached statement does
+ * what sqlexec does with the same values formatted into the SQL. */
+
+#include <cstdio>
+#include <string>
+#include "check.h"
+#include "sqlstmt.h"
+
+using namespace std;
+
+static void
+reuse (sqlite3 *db)
+{
+  static const char sql[] = "INSERT INTO t (b) VALUES (?);";
+  sqlite3_stmt *first;
+  {
+    sqlstmt_t s = sqlstmt_t::cached (db, sql);
+    first = s.get();
+    s.param("x").step();
+  }
+  {
+    sqlstmt_t s = sqlstmt_t::cached (db, sql);
+    CHECK (s.get() == first);
+    // Reset when it went back to the cache, so it runs again
+    s.param("y").step();
+    sqlstmt_t held = sqlstmt_t::cached (db, sql);
+    CHECK (held.get() != first);
+  }
+  CHECK (sqlstmt_t (db, "SELECT count(*) FROM t;").step().integer(0) == 2);
+
+  bool caught = false;
+  try {
+    sqlexec_cached (db, "SELECT 1; SELECT 2;");
+  }
+  catch (const sqlerr_t &) {
+    caught = true;
+  }
+  CHECK (caught);
+}
+
+/* The same updates through both, on two copies of a table. */
+static void
+equivalence (sqlite3 *db, int n)
+{
+  sqlexec (db, "CREATE TABLE u1 (a INTEGER PRIMARY KEY, b TEXT, c INTEGER);"
+	   "CREATE TABLE u2 (a INTEGER PRIMARY KEY, b TEXT, c INTEGER);");
+  for (int i = 0; i < n; i++) {
+    string b = "it's #" + to_string (i % 37);
+    long long a = i % 101, c = i * 7;
+    sqlexec (db, "INSERT OR REPLACE INTO u1 VALUES (%lld, %Q, %lld);",
+	     a, b.c_str(), c);
+    sqlexec_cached (db, "INSERT OR REPLACE INTO u2 VALUES (?, ?, ?);",
+		    i64 (a), b, i64 (c));
+  }
+  CHECK (sqlstmt_t (db, "SELECT count(*) FROM (SELECT * FROM u1 EXCEPT"
+		    " SELECT * FROM u2);").step().integer(0) == 0);
+  CHECK (sqlstmt_t (db, "SELECT count(*) FROM u2;").step().integer(0) == 101);
+  cout << n << " statements did the same both ways\n";
+}
+
+static void
+throughput (sqlite3 *db, int n)
+{
+  // Other statements in the cache, as in a real session
+  for (int i = 0; i < 100; i++)
+    sqlstmt_t::cached (db, ("SELECT " + to_string (i) + ";").c_str()).step();
+  double plain = best_of (3, [&]() {
+      for (int i = 0; i < n; i++)
+	sqlexec (db, "UPDATE t SET b = %Q WHERE a = %lld;", "y", 1LL);
+    });
+  double cached = best_of (3, [&]() {
+      for (int i = 0; i < n; i++)
+	sqlexec_cached (db, "UPDATE t SET b = ? WHERE a = ?;", "y", i64 (1));
+    });
+  printf ("%d single-row UPDATEs: sqlexec %.2f s (%.2f us each),"
+	  " sqlexec_cached %.2f s (%.2f us each)\n", n, plain,
+	  plain / n * 1e6, cached, cached / n * 1e6);
+}
+
+int
+main (int argc, char **argv)
+{
+  check_init (argc, argv);
+  sqlite3 *db;
+  if (!CHECK (sqlite3_open (":memory:", &db) == SQLITE_OK))
+    return check_result();
+  sqlexec (db, "CREATE TABLE t (a INTEGER PRIMARY KEY, b TEXT);");
+  reuse (db);
+  equivalence (db, check_size (2000, 20000));
+  if (bench)
+    throughput (db, 200000);
+  // Statements still held are finalized with the connection
+  sqlstmt_t held = sqlstmt_t::cached (db, "SELECT b FROM t;");
+  sqlclose (db);
+  return check_result();
+}
@@ -0,0 +1,191 @@
+
+/* typed_stmt against plain sqlstmt_t column access: the same rows
+ * read both ways, then the cost of each. */
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <tuple>
+#include <vector>
+#include "check.h"
+#include "sqlstmt.h"
+
+using namespace std;
+
+using row = tuple<i64, i64, i64, string, string>;
+static const char scan_sql[] =
+  "SELECT docid, replica, version, hash, message_id FROM m ORDER BY docid;";
+static const char lookup_sql[] =
+  "SELECT replica, version, message_id FROM m WHERE docid = ?;";
+
+static void
+fill (sqlite3 *db, int n)
+{
+  mt19937_64 rng (1);
+  sqlexec (db, "CREATE TABLE m (docid INTEGER PRIMARY KEY, replica INTEGER,"
+	   " version INTEGER, hash BLOB, message_id TEXT);");
+  sqlexec (db, "BEGIN;");
+  sqlstmt_t ins (db, "INSERT INTO m VALUES (?, ?, ?, ?, ?);");
+  for (int i = 1; i <= n; i++) {
+    string hash (20, '\0');
+    for (char &c : hash)
+      c = char (rng());
+    char id[80];
+    snprintf (id, sizeof id, "<%016llx.%d@mail.example.org>",
+	      (unsigned long long) rng(), i);
+    // Every so often, a NULL, an empty blob, or a NUL inside the text
+    if (i % 97 == 0)
+      ins.reset().param(i64(i), i64(rng() % 8), i64(i), nullptr,
+			string ("a\0b", 3)).step();
+    else if (i % 89 == 0)
+      ins.reset().param(i64(i), i64(rng() % 8), i64(i), sqlbytes(),
+			string()).step();
+    else
+      ins.reset().param(i64(i), i64(rng() % 8), i64(i), sqlbytes(hash),
+			string(id)).step();
+  }
+  sqlexec (db, "COMMIT;");
+}
+
+static vector<row>
+scan_plain (sqlite3 *db)
+{
+  vector<row> ret;
+  sqlstmt_t s (db, "%s", scan_sql);
+  for (s.step(); s.row(); s.step())
+    ret.emplace_back (s.integer(0), s.integer(1), s.integer(2), s.str(3),
+		      s.str(4));
+  return ret;
+}
+
+static vector<row>
+scan_typed (sqlite3 *db)
+{
+  vector<row> ret;
+  typed_stmt<sqlparams<>, sqlcolumns<i64, i64, i64, sqlbytes, sqlbytes>>
+    s (db, "%s", scan_sql);
+  for (s.run(); s.row(); s.step())
+    ret.emplace_back (s.get<0>(), s.get<1>(), s.get<2>(), s.get<3>().str(),
+		      s.get<4>().str());
+  return ret;
+}
+
+static vector<row>
+scan_tuples (sqlite3 *db)
+{
+  vector<row> ret;
+  typed_stmt<sqlparams<>, sqlcolumns<i64, i64, i64, string, string>>
+    s (db, "%s", scan_sql);
+  s.run();
+  for (const auto &r : s)
+    ret.push_back (r);
+  return ret;
+}
+
+static void
+equivalence (sqlite3 *db, int n)
+{
+  vector<row> plain = scan_plain (db);
+  CHECK (plain.size() == size_t (n));
+  CHECK (scan_typed (db) == plain);
+  CHECK (scan_tuples (db) == plain);
+
+  sqlstmt_t p (db, "%s", lookup_sql);
+  typed_stmt<sqlparams<i64>, sqlcolumns<i64, i64, sqlbytes>>
+    t (db, "%s", lookup_sql);
+  for (i64 k = 0; k <= n + 1; k++) {
+    bool found = p.reset().param(k).step().row();
+    CHECK (t.run(k).row() == found);
+    if (found)
+      CHECK (t.get<0>() == p.integer(0) && t.get<1>() == p.integer(1)
+	     && t.get<2>().str() == p.str(2));
+  }
+
+  // Parameter and column counts are checked once, when prepared
+  bool caught = false;
+  try {
+    typed_stmt<sqlparams<>, sqlcolumns<i64>> bad (db, "%s", scan_sql);
+  }
+  catch (const sqlerr_t &) {
+    caught = true;
+  }
+  CHECK (caught);
+  cout << n << " rows read the same both ways\n";
+}
+
+static void
+throughput (sqlite3 *db, int n)
+{
+  size_t sink = 0;
+  double plain = best_of (5, [&]() {
+      sqlstmt_t s (db, "%s", scan_sql);
+      for (s.step(); s.row(); s.step()) {
+	sink += s.integer(0) + s.integer(1) + s.integer(2);
+	string h = s.str(3), m = s.str(4);
+	sink += h.size() + m.size();
+      }
+    });
+  double typed = best_of (5, [&]() {
+      typed_stmt<sqlparams<>, sqlcolumns<i64, i64, i64, sqlbytes, sqlbytes>>
+	s (db, "%s", scan_sql);
+      for (s.run(); s.row(); s.step())
+	sink += s.get<0>() + s.get<1>() + s.get<2>() + s.get<3>().size
+	  + s.get<4>().size;
+    });
+  double tuples = best_of (5, [&]() {
+      typed_stmt<sqlparams<>, sqlcolumns<i64, i64, i64, string, string>>
+	s (db, "%s", scan_sql);
+      s.run();
+      for (const auto &r : s)
+	sink += get<0>(r) + get<3>(r).size() + get<4>(r).size();
+    });
+
+  vector<i64> keys (n);
+  for (int i = 0; i < n; i++)
+    keys[i] = i + 1;
+  shuffle (keys.begin(), keys.end(), mt19937_64 (2));
+  double plain_lookup = best_of (5, [&]() {
+      sqlstmt_t s (db, "%s", lookup_sql);
+      for (i64 k : keys) {
+	s.reset().param(k).step();
+	sink += s.integer(0) + s.integer(1) + s.str(2).size();
+      }
+    });
+  double typed_lookup = best_of (5, [&]() {
+      typed_stmt<sqlparams<i64>, sqlcolumns<i64, i64, sqlbytes>>
+	s (db, "%s", lookup_sql);
+      for (i64 k : keys) {
+	s.run(k);
+	sink += s.get<0>() + s.get<1>() + s.get<2>().size;
+      }
+    });
+
+  printf ("scan, sqlstmt_t integer()/str()       %6.1f ns/row\n",
+	  plain / n * 1e9);
+  printf ("scan, typed_stmt get<I>() as sqlbytes %6.1f ns/row\n",
+	  typed / n * 1e9);
+  printf ("scan, typed_stmt tuples of strings    %6.1f ns/row\n",
+	  tuples / n * 1e9);
+  printf ("lookup by docid, sqlstmt_t            %6.1f ns/row\n",
+	  plain_lookup / n * 1e9);
+  printf ("lookup by docid, typed_stmt sqlbytes  %6.1f ns/row\n",
+	  typed_lookup / n * 1e9);
+  if (!sink)
+    cout << '\n';
+}
+
+int
+main (int argc, char **argv)
+{
+  check_init (argc, argv);
+  int n = check_size (20000, 500000);
+  sqlite3 *db;
+  if (!CHECK (sqlite3_open (":memory:", &db) == SQLITE_OK))
+    return check_result();
+  fill (db, n);
+  equivalence (db, n);
+  if (bench)
+    throughput (db, n);
+  sqlclose (db);
+  return check_result();
+}
@@ -8,11 +8,15 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include <xapian.h>
 
 #include "muchsync.h"
 #include "misc.h"
+#include "xapian_vtab.h"
 
 using namespace std;
 
@@ -126,44 +130,34 @@ static void
 xapian_scan_tags (sqlite3 *sqldb, Xapian::Database &xdb, const writestamp &ws)
 {
   sqlexec(sqldb, "DROP TABLE IF EXISTS dead_tags; "
-	  "CREATE TEMP TABLE dead_tags (tag TEXT PRIMARY KEY); "
-	  "INSERT INTO dead_tags SELECT DISTINCT tag FROM tags;");
+	  "CREATE TEMP TABLE dead_tags (tag_id INTEGER PRIMARY KEY); "
+	  "INSERT INTO dead_tags SELECT DISTINCT tag_id FROM tags;");
+  /* Each tag's delta is a pair of set operations against its
+   * postings, which SQLite runs without coming back to us per row. */
   sqlstmt_t
-    scan (sqldb, "SELECT docid, rowid FROM tags"
-	  " WHERE tag = ? ORDER BY docid ASC;"),
-    add_tag (sqldb, "INSERT INTO tags (docid, tag) VALUES (?, ?);"),
-    del_tag (sqldb, "DELETE FROM tags WHERE rowid = ?;"),
-    record_tag (sqldb, "DELETE FROM dead_tags WHERE tag = ?;");
+    del_tags (sqldb, "DELETE FROM tags WHERE tag_id = ?1 AND docid NOT IN"
+	      " (SELECT docid FROM xapian_postings (?2));"),
+    add_tags (sqldb, "INSERT INTO tags (docid, tag_id)"
+	      " SELECT docid, ?1 FROM xapian_postings (?2)"
+	      " WHERE docid NOT IN (SELECT docid FROM tags WHERE tag_id = ?1);"),
+    record_tag (sqldb, "DELETE FROM dead_tags WHERE tag_id = ?;");
 
   for (Xapian::TermIterator ti = xdb.allterms_begin(notmuch_tag_prefix),
 	 te = xdb.allterms_end(notmuch_tag_prefix); ti != te; ti++) {
-    string tag = tag_from_term (*ti);
+    string term = *ti;
+    string tag = tag_from_term (term);
     if (opt_verbose > 1)
       cerr << "  " << tag << "\n";
-    record_tag.reset().param(tag).step();
-    scan.reset().bind_text(1, tag);
-    add_tag.reset().bind_text(2, tag);
-
-    Xapian::PostingIterator pi = xdb.postlist_begin (*ti),
-      pe = xdb.postlist_end (*ti);
-
-    sync_table<Xapian::PostingIterator>
-      (scan, pi, pe,
-       [] (sqlstmt_t &s, Xapian::PostingIterator &p) -> int {
-	 return s.integer(0) - *p;
-       },
-       [&] (sqlstmt_t *sp, Xapian::PostingIterator *pp) {
-	 if (!sp)
-	   add_tag.reset().bind_int(1, **pp).step();
-	 else if (!pp)
-	   del_tag.reset().bind_value(1, sp->value(1)).step();
-       });
+    tag_id id = intern_tag (sqldb, tag);
+    record_tag.reset().param(id).step();
+    del_tags.reset().param(id, term).step();
+    add_tags.reset().param(id, term).step();
   }
 
-  sqlexec(sqldb, "DELETE FROM tags WHERE tag IN (SELECT * FROM dead_tags);");
-  sqlexec(sqldb, "UPDATE message_ids SET replica = %lld, version = %lld"
-	  " WHERE docid IN (SELECT docid FROM modified_docids WHERE new = 0);",
-	  ws.first, ws.second);
+  sqlexec(sqldb, "DELETE FROM tags WHERE tag_id IN (SELECT * FROM dead_tags);");
+  sqlexec_cached(sqldb, "UPDATE message_ids SET replica = ?, version = ?"
+		 " WHERE docid IN (SELECT docid FROM modified_docids"
+		 " WHERE new = 0);", ws.first, ws.second);
 }
 
 static void
@@ -173,12 +167,14 @@ xapian_scan_message_ids (sqlite3 *sqldb, const writestamp &ws,
   sqlstmt_t
     scan(sqldb,
 	  "SELECT message_id, docid FROM message_ids ORDER BY docid ASC;"),
-    add_message(sqldb,
-		"INSERT INTO message_ids (message_id, docid, replica, version)"
-		" VALUES (?, ?, %lld, %lld);", ws.first, ws.second),
-    flag_new_message(sqldb, "INSERT INTO modified_docids (docid, new)"
-		     " VALUES (?, 1);"),
     del_message(sqldb, "DELETE FROM message_ids WHERE docid = ?;");
+  sqlbulk<string, i64, i64>
+    add_message(sqldb, "INSERT INTO message_ids"
+		" (message_id, msgid_fp, docid, replica, version)",
+		"(?, ?, ?, " + to_string(ws.first) + ", "
+		+ to_string(ws.second) + ")");
+  sqlbulk<i64> flag_new_message(sqldb, "INSERT INTO modified_docids"
+				" (docid, new)", "(?, 1)");
 
   Xapian::PostingIterator
     gi = xdb.postlist_begin(notmuch_ghost_term),
@@ -206,8 +202,8 @@ xapian_scan_message_ids (sqlite3 *sqldb, const writestamp &ws,
        }
        if (!sp) {
 	 i64 docid = vip->get_docid();
-	 add_message.reset().param(**vip, docid).step();
-	 flag_new_message.reset().param(docid).step();
+	 add_message.add(**vip, msgid_fp(**vip), docid);
+	 flag_new_message.add(docid);
        }
        else if (!vip)
 	 del_message.reset().param(sp->value(1)).step();
@@ -216,9 +212,11 @@ xapian_scan_message_ids (sqlite3 *sqldb, const writestamp &ws,
 	 cerr << "warning: message id changed from <"
 	      << sp->str(0) << "> to <" << **vip << ">\n";
 	 del_message.reset().param(sp->value(1)).step();
-	 add_message.reset().param(**vip, i64(vip->get_docid())).step();
+	 add_message.add(**vip, msgid_fp(**vip), i64(vip->get_docid()));
        }
      });
+  add_message.flush();
+  flag_new_message.flush();
 }
 
 static Xapian::docid
@@ -244,8 +242,8 @@ xapian_scan_directories (sqlite3 *sqldb, Xapian::Database &xdb)
     delfiles(sqldb, "DELETE FROM xapian_files WHERE dir_docid = ?;"),
     adddir(sqldb, "INSERT INTO xapian_dirs (dir_path, dir_docid, dir_mtime)"
 	   " VALUES (?, ?, ?);"),
-    upddir(sqldb, "UPDATE xapian_dirs SET dir_mtime = ? WHERE dir_docid = ?;"),
-    flagdir(sqldb, "INSERT INTO modified_xapian_dirs (dir_docid) VALUES (?);");
+    upddir(sqldb, "UPDATE xapian_dirs SET dir_mtime = ? WHERE dir_docid = ?;");
+  sqlbulk<i64> flagdir(sqldb, "INSERT INTO modified_xapian_dirs (dir_docid)");
 
 
   Xapian::TermIterator
@@ -289,18 +287,19 @@ xapian_scan_directories (sqlite3 *sqldb, Xapian::Database &xdb)
       deldir.reset().param(i64(dir_docid)).step();
       delfiles.reset().param(i64(dir_docid)).step();
       adddir.reset().param(dir, i64(dir_docid), i64(mtime)).step();
-      flagdir.reset().param(i64(dir_docid)).step();
+      flagdir.add(i64(dir_docid));
       ++ti;
       continue;
     }
 
     if (mtime != scandirs.integer(2)) {
-      flagdir.reset().param(i64(dir_docid)).step();
+      flagdir.add(i64(dir_docid));
       upddir.reset().param(i64(mtime), i64(dir_docid)).step();
     }
     ++ti;
     scandirs.step();
   }
+  flagdir.flush();
 }
 
 class fileops {
@@ -309,12 +308,13 @@ public:
 private:
   sqlstmt_t get_msgid_;
   sqlstmt_t del_file_;
-  sqlstmt_t add_file_;
+  sqlbulk<i64, string, i64, double, i64, i64> add_file_;
   sqlstmt_t upd_file_;
   sqlstmt_t get_hashid_;
   sqlstmt_t get_hash_;
   sqlstmt_t add_hash_;
   sqlstmt_t upd_hash_;
+  writestamp ws_;
   string get_msgid(i64 docid);
   i64 get_file_hash_id(int dfd, const string &file, i64 docid);
 public:
@@ -323,30 +323,41 @@ public:
   void add_file(const string &dir, int dfd, i64 dir_docid,
 		string name, i64 docid);
   void check_file(const string &dir, int dfd, i64 dir_docid);
+  /** Write out the files add_file and check_file have queued */
+  void flush() { add_file_.flush(); }
 };
 
 fileops::fileops(sqlite3 *db, const writestamp &ws)
-  : scan_dir_(db, "SELECT rowid, name, docid%s"
-	      " FROM xapian_files WHERE dir_docid = ? ORDER BY name;",
-	      opt_fullscan ? ", mtime, inode, hash_id" : ""),
-    get_msgid_(db, "SELECT message_id FROM message_ids WHERE docid = ?;"),
-    del_file_(db, "DELETE FROM xapian_files WHERE rowid = ?;"),
+  : scan_dir_(sqlstmt_t::cached
+	      (db, opt_fullscan
+	       ? "SELECT rowid, name, docid, mtime, inode, hash_id"
+		 " FROM xapian_files WHERE dir_docid = ? ORDER BY name;"
+	       : "SELECT rowid, name, docid"
+		 " FROM xapian_files WHERE dir_docid = ? ORDER BY name;")),
+    get_msgid_(sqlstmt_t::cached
+	       (db, "SELECT message_id FROM message_ids WHERE docid = ?;")),
+    del_file_(sqlstmt_t::cached
+	      (db, "DELETE FROM xapian_files WHERE rowid = ?;")),
     add_file_(db, "INSERT INTO xapian_files"
-	      " (dir_docid, name, docid, mtime, inode, hash_id)"
-	      " VALUES (?, ?, ?, ?, ?, ?);"),
-    upd_file_(db, "UPDATE xapian_files SET mtime = ?, inode = ?"
-	      " WHERE rowid = ?;"),
-    get_hashid_(db, opt_fullscan
-	      ? "SELECT hash_id, size, message_id FROM maildir_hashes"
-	        " WHERE hash = ?;"
-	      : "SELECT hash_id FROM maildir_hashes WHERE hash = ?;"),
-    get_hash_(db, "SELECT hash, size FROM maildir_hashes WHERE hash_id = ?;"),
-    add_hash_(db, "INSERT OR REPLACE INTO maildir_hashes "
-	      " (hash, size, message_id, replica, version)"
-	      " VALUES (?, ?, ?, %lld, %lld);", ws.first, ws.second),
-    upd_hash_(db, "UPDATE maildir_hashes SET size = ?, message_id = ?"
-	      " WHERE hash_id = ?;",
-	      ws.first, ws.second)
+	      " (dir_docid, name, docid, mtime, inode, hash_id)"),
+    upd_file_(sqlstmt_t::cached
+	      (db, "UPDATE xapian_files SET mtime = ?, inode = ?"
+	       " WHERE rowid = ?;")),
+    get_hashid_(sqlstmt_t::cached
+		(db, opt_fullscan
+		 ? "SELECT hash_id, size, message_id FROM maildir_hashes"
+		   " WHERE hash = ?;"
+		 : "SELECT hash_id FROM maildir_hashes WHERE hash = ?;")),
+    get_hash_(sqlstmt_t::cached
+	      (db, "SELECT size FROM maildir_hashes WHERE hash_id = ?;")),
+    add_hash_(sqlstmt_t::cached
+	      (db, "INSERT OR REPLACE INTO maildir_hashes "
+	       " (size, message_id, replica, version, hash)"
+	       " VALUES (?, ?, ?, ?, ?);")),
+    upd_hash_(sqlstmt_t::cached
+	      (db, "UPDATE maildir_hashes SET size = ?, message_id = ?"
+	       " WHERE hash_id = ?;")),
+    ws_(ws)
 {
 }
 
@@ -366,8 +377,9 @@ fileops::get_file_hash_id(int dfd, const string &name, i64 docid)
   if (opt_verbose > 2)
     cerr << "    " << name << '\n';
   string hash = get_sha(dfd, name.c_str(), &sz);
+  string key = hash_to_key (hash);
 
-  if (get_hashid_.reset().param(hash).step().row()) {
+  if (get_hashid_.reset().bind_blob(1, key.data(), key.size()).step().row()) {
     i64 hash_id = get_hashid_.integer(0);
     if (!opt_fullscan)
       return hash_id;
@@ -380,7 +392,8 @@ fileops::get_file_hash_id(int dfd, const string &name, i64 docid)
     return hash_id;
   }
 
-  add_hash_.reset().param(hash, sz, get_msgid(docid)).step();
+  add_hash_.reset().param(sz, get_msgid(docid), ws_.first, ws_.second)
+    .bind_blob(5, key.data(), key.size()).step();
   return sqlite3_last_insert_rowid(add_hash_.getdb());
 }
 
@@ -398,9 +411,8 @@ fileops::add_file(const string &dir, int dfd, i64 dir_docid,
     return;
 
   i64 hash_id = get_file_hash_id(dfd, name, docid);
-  add_file_.reset()
-    .param(dir_docid, name, docid, ts_to_double(sb.ST_MTIM),
-	   i64(sb.st_ino), hash_id).step();
+  add_file_.add(dir_docid, move(name), docid, ts_to_double(sb.ST_MTIM),
+		i64(sb.st_ino), hash_id);
 }
 
 void
@@ -426,7 +438,7 @@ fileops::check_file(const string &dir, int dfd, i64 dir_docid)
   i64 db_hashid = scan_dir_.integer(5);
   if (!get_hash_.reset().param(db_hashid).step().row())
     throw runtime_error ("invalid hash_id: " + to_string(db_hashid));
-  i64 db_size = get_hash_.integer(1);
+  i64 db_size = get_hash_.integer(0);
 
   if (fs_mtim == db_mtim && fs_inode == db_inode && fs_size == db_size)
     return;
@@ -437,8 +449,7 @@ fileops::check_file(const string &dir, int dfd, i64 dir_docid)
     upd_file_.reset().param(fs_mtim, fs_inode, rowid).step();
   else {
     del_file_.reset().param(rowid).step();
-    add_file_.reset().param(dir_docid, name, docid, fs_mtim, fs_inode,
-			    fs_hashid);
+    add_file_.add(dir_docid, name, docid, fs_mtim, fs_inode, fs_hashid);
   }
 }
 
@@ -524,6 +535,7 @@ xapian_scan_filenames (sqlite3 *db, const string &maildir,
       }
     }
   }
+  f.flush();
 }
 
 static void
@@ -588,6 +600,7 @@ xapian_scan(sqlite3 *sqldb, writestamp ws, string maildir)
     maildir = ".";
   print_time ("starting scan of Xapian database");
   Xapian::Database xdb (maildir + "/.notmuch/xapian");
+  xapian_vtab_register (sqldb, xdb);
   set_triggers(sqldb);
   print_time ("opened Xapian");
   xapian_scan_message_ids (sqldb, ws, xdb);
@@ -602,16 +615,69 @@ xapian_scan(sqlite3 *sqldb, writestamp ws, string maildir)
   print_time ("adjusted link counts");
 }
 
+/* Summarizes the names, sizes, and modification times of the files
+ * in the Xapian database, which changes whenever anyone commits to it.
+ * Much cheaper than opening the database. */
+i64
+xapian_fingerprint (const string &maildir)
+{
+  string path = maildir + "/.notmuch/xapian";
+  DIR *d = opendir (path.c_str());
+  if (!d)
+    return -1;
+  cleanup _closedir (closedir, d);
+  i64 fp = 0;
+  struct stat sb;
+  while (dirent *e = readdir (d)) {
+    if (fstatat (dirfd (d), e->d_name, &sb, 0) || !S_ISREG (sb.st_mode))
+      continue;
+    i64 h = std::hash<string>()(e->d_name);
+    h = h * 31 + sb.st_size;
+    h = h * 31 + sb.ST_MTIM.tv_sec;
+    h = h * 31 + sb.ST_MTIM.tv_nsec;
+    fp += h;
+  }
+  return fp;
+}
+
+/* A descriptor that becomes readable when a file in the Xapian
+ * database is written, created, renamed, or removed, so that waiting
+ * for a change need not call xapian_fingerprint over and over.  -1
+ * if the system has no inotify. */
+int
+xapian_watch (const string &maildir)
+{
+#if HAVE_SYS_INOTIFY_H
+  int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  string path = maildir + "/.notmuch/xapian";
+  if (inotify_add_watch (fd, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE
+			 | IN_CREATE | IN_MOVED_TO | IN_DELETE) < 0) {
+    close (fd);
+    return -1;
+  }
+  return fd;
+#else
+  return -1;
+#endif
+}
+
 void
 sync_local_data (sqlite3 *sqldb, const string &maildir)
 {
   print_time ("synchronizing muchsync database with Xapian");
-  sqlexec (sqldb, "SAVEPOINT localsync;");
+  // The first scan of a replica loads everything at once
+  bool initial = !sqlstmt_t::cached (sqldb, "SELECT 1 FROM message_ids"
+				     " LIMIT 1;").step().row();
+  if (initial)
+    set_db_profile (sqldb, db_profile::bulk);
+  sqlexec_cached (sqldb, "SAVEPOINT localsync;");
 
   try {
     i64 self = getconfig<i64>(sqldb, "self");
-    sqlexec (sqldb, "UPDATE sync_vector"
-	     " SET version = version + 1 WHERE replica = %lld;", self);
+    sqlexec_cached (sqldb, "UPDATE sync_vector"
+		    " SET version = version + 1 WHERE replica = ?;", self);
     if (sqlite3_changes (sqldb) != 1)
       throw runtime_error ("My replica id (" + to_string (self)
 			   + ") not in sync vector");
@@ -623,9 +689,14 @@ sync_local_data (sqlite3 *sqldb, const string &maildir)
   }
   catch (...) {
     sqlexec (sqldb, "ROLLBACK TO localsync;");
+    load_tag_names (sqldb);
+    if (initial)
+      set_db_profile (sqldb, db_profile::interactive);
     throw;
   }
-  sqlexec (sqldb, "RELEASE localsync;");
+  sqlexec_cached (sqldb, "RELEASE localsync;");
+  if (initial)
+    set_db_profile (sqldb, db_profile::interactive);
   print_time ("finished synchronizing muchsync database with Xapian");
 }
 
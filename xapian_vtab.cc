@@ -0,0 +1,269 @@
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include "sqlstmt.h"
+#include "xapian_vtab.h"
+
+using namespace std;
+
+namespace {
+
+/* What the tables of one connection read, shared by both modules */
+struct xapian_aux {
+  sqlite3 *db;
+  Xapian::Database xdb;
+};
+unordered_map<sqlite3 *, xapian_aux *> registered;
+
+enum table_kind { terms_table, postings_table };
+
+/* Column 1 of either table is the hidden argument */
+constexpr int arg_column = 1;
+
+struct xvtab : sqlite3_vtab {
+  table_kind kind;
+  xapian_aux *aux;
+};
+
+struct xcursor : sqlite3_vtab_cursor {
+  Xapian::Database xdb;		// As of xFilter
+  string arg;			// Prefix or term
+  Xapian::TermIterator ti, te;
+  Xapian::PostingIterator pi, pe;
+  string term;			// *ti
+  sqlite3_int64 rowid = 0;
+  bool eof = true;
+  table_kind kind() const { return static_cast<xvtab *> (pVtab)->kind; }
+};
+
+int
+set_error (sqlite3_vtab *vt, const string &msg)
+{
+  sqlite3_free (vt->zErrMsg);
+  vt->zErrMsg = sqlite3_mprintf ("%s", msg.c_str());
+  return SQLITE_ERROR;
+}
+
+template<table_kind K> int
+x_connect (sqlite3 *db, void *aux, int, const char *const *,
+	   sqlite3_vtab **vtp, char **)
+{
+  int err = sqlite3_declare_vtab
+    (db, K == terms_table ? "CREATE TABLE x (term TEXT, prefix HIDDEN);"
+     : "CREATE TABLE x (docid INTEGER, term HIDDEN);");
+  if (err != SQLITE_OK)
+    return err;
+  xvtab *vt = new xvtab ();
+  vt->kind = K;
+  vt->aux = static_cast<xapian_aux *> (aux);
+  *vtp = vt;
+  return SQLITE_OK;
+}
+
+int
+x_disconnect (sqlite3_vtab *vt)
+{
+  delete static_cast<xvtab *> (vt);
+  return SQLITE_OK;
+}
+
+int
+x_best_index (sqlite3_vtab *vt, sqlite3_index_info *info)
+{
+  for (int i = 0; i < info->nConstraint; i++) {
+    const auto &c = info->aConstraint[i];
+    if (c.iColumn == arg_column && c.op == SQLITE_INDEX_CONSTRAINT_EQ
+	&& c.usable) {
+      info->aConstraintUsage[i].argvIndex = 1;
+      info->aConstraintUsage[i].omit = 1;
+      info->idxNum = 1;
+      info->estimatedCost = 1000;
+      // Postings come in docid order (terms too, but maybe not in
+      // the collating sequence asked for)
+      if (static_cast<xvtab *> (vt)->kind == postings_table
+	  && info->nOrderBy == 1 && info->aOrderBy[0].iColumn == 0
+	  && !info->aOrderBy[0].desc)
+	info->orderByConsumed = 1;
+      return SQLITE_OK;
+    }
+  }
+  // Without an argument, xapian_terms lists every term, and
+  // xapian_postings fails in x_filter
+  info->idxNum = 0;
+  info->estimatedCost = 1e12;
+  return SQLITE_OK;
+}
+
+int
+x_open (sqlite3_vtab *, sqlite3_vtab_cursor **curp)
+{
+  *curp = new xcursor ();
+  return SQLITE_OK;
+}
+
+int
+x_close (sqlite3_vtab_cursor *cur)
+{
+  delete static_cast<xcursor *> (cur);
+  return SQLITE_OK;
+}
+
+/* Set eof and load the current row, once ti or pi has moved */
+void
+x_settle (xcursor *c)
+{
+  if (c->kind() == terms_table) {
+    c->eof = c->ti == c->te;
+    if (!c->eof)
+      c->term = *c->ti;
+  }
+  else
+    c->eof = c->pi == c->pe;
+}
+
+int
+x_filter (sqlite3_vtab_cursor *cur, int idxnum, const char *,
+	  int, sqlite3_value **argv)
+{
+  xcursor *c = static_cast<xcursor *> (cur);
+  xvtab *vt = static_cast<xvtab *> (cur->pVtab);
+  c->rowid = 0;
+  c->eof = true;
+  c->arg.clear();
+  if (idxnum) {
+    // Nothing is equal to NULL
+    const char *p = reinterpret_cast<const char *>
+      (sqlite3_value_text (argv[0]));
+    if (!p)
+      return SQLITE_OK;
+    c->arg.assign (p, sqlite3_value_bytes (argv[0]));
+  }
+  else if (vt->kind == postings_table)
+    return set_error (vt, "xapian_postings: no term given");
+  try {
+    c->xdb = vt->aux->xdb;
+    if (vt->kind == terms_table) {
+      c->ti = c->xdb.allterms_begin (c->arg);
+      c->te = c->xdb.allterms_end (c->arg);
+    }
+    else {
+      c->pi = c->xdb.postlist_begin (c->arg);
+      c->pe = c->xdb.postlist_end (c->arg);
+    }
+    x_settle (c);
+  }
+  catch (const Xapian::Error &e) {
+    return set_error (vt, "xapian: " + e.get_msg());
+  }
+  return SQLITE_OK;
+}
+
+int
+x_next (sqlite3_vtab_cursor *cur)
+{
+  xcursor *c = static_cast<xcursor *> (cur);
+  try {
+    if (c->kind() == terms_table)
+      ++c->ti;
+    else
+      ++c->pi;
+    x_settle (c);
+  }
+  catch (const Xapian::Error &e) {
+    return set_error (cur->pVtab, "xapian: " + e.get_msg());
+  }
+  c->rowid++;
+  return SQLITE_OK;
+}
+
+int
+x_eof (sqlite3_vtab_cursor *cur)
+{
+  return static_cast<xcursor *> (cur)->eof;
+}
+
+int
+x_column (sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int i)
+{
+  xcursor *c = static_cast<xcursor *> (cur);
+  if (i == arg_column)
+    sqlite3_result_text (ctx, c->arg.data(), c->arg.size(),
+			 SQLITE_TRANSIENT);
+  else if (c->kind() == terms_table)
+    sqlite3_result_text (ctx, c->term.data() + c->arg.size(),
+			 c->term.size() - c->arg.size(), SQLITE_TRANSIENT);
+  else {
+    try {
+      sqlite3_result_int64 (ctx, *c->pi);
+    }
+    catch (const Xapian::Error &e) {
+      string msg = "xapian: " + e.get_msg();
+      sqlite3_result_error (ctx, msg.c_str(), msg.size());
+    }
+  }
+  return SQLITE_OK;
+}
+
+int
+x_rowid (sqlite3_vtab_cursor *cur, sqlite3_int64 *rowidp)
+{
+  *rowidp = static_cast<xcursor *> (cur)->rowid;
+  return SQLITE_OK;
+}
+
+/* Without xCreate, the tables are eponymous-only: they exist as soon
+ * as the module is registered, and cannot be created otherwise. */
+sqlite3_module
+make_module (int (*connect) (sqlite3 *, void *, int, const char *const *,
+			     sqlite3_vtab **, char **))
+{
+  sqlite3_module m;
+  memset (&m, 0, sizeof (m));
+  m.xConnect = connect;
+  m.xBestIndex = x_best_index;
+  m.xDisconnect = x_disconnect;
+  m.xOpen = x_open;
+  m.xClose = x_close;
+  m.xFilter = x_filter;
+  m.xNext = x_next;
+  m.xEof = x_eof;
+  m.xColumn = x_column;
+  m.xRowid = x_rowid;
+  return m;
+}
+
+const sqlite3_module terms_module = make_module (x_connect<terms_table>);
+const sqlite3_module postings_module = make_module (x_connect<postings_table>);
+
+void
+destroy_aux (void *p)
+{
+  xapian_aux *aux = static_cast<xapian_aux *> (p);
+  registered.erase (aux->db);
+  delete aux;
+}
+
+}
+
+void
+xapian_vtab_register (sqlite3 *db, const Xapian::Database &xdb)
+{
+  auto i = registered.find (db);
+  if (i != registered.end()) {
+    i->second->xdb = xdb;
+    return;
+  }
+  xapian_aux *aux = new xapian_aux { db, xdb };
+  if (sqlite3_create_module_v2 (db, "xapian_terms", &terms_module,
+				aux, nullptr) != SQLITE_OK) {
+    delete aux;
+    throw sqlerr_t (string ("xapian_terms: ") + sqlite3_errmsg (db));
+  }
+  // xapian_postings owns aux, and frees it with the connection
+  if (sqlite3_create_module_v2 (db, "xapian_postings", &postings_module,
+				aux, destroy_aux) != SQLITE_OK)
+    throw sqlerr_t (string ("xapian_postings: ") + sqlite3_errmsg (db));
+  registered.emplace (db, aux);
+}
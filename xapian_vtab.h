@@ -0,0 +1,37 @@
+// -*- C++ -*-
+
+#ifndef _XAPIAN_VTAB_H_
+#define _XAPIAN_VTAB_H_ 1
+
+/** \file xapian_vtab.h
+ *  \brief Read-only SQLite table-valued functions over Xapian terms
+ *  and postings.
+ */
+
+#include <sqlite3.h>
+#include <xapian.h>
+
+/** \brief Make the terms and postings of xdb visible to SQL on db.
+ *
+ * Registers two eponymous virtual tables, used as table-valued
+ * functions:
+ *
+ *  - `xapian_terms(prefix)` has a row for each term starting with
+ *    `prefix`, in increasing byte order, with column `term` holding
+ *    the term less the prefix.
+ *
+ *  - `xapian_postings(term)` has a row for each document indexed by
+ *    `term`, in increasing order of column `docid`.
+ *
+ * So, e.g., one tag's delta against the tags table is
+ *
+ *     SELECT docid FROM xapian_postings('Kinbox')
+ *       WHERE docid NOT IN (SELECT docid FROM tags WHERE tag_id = ?);
+ *
+ * which SQLite runs as a single statement.  Calling this again with
+ * another database (e.g., to see changes since the last scan)
+ * switches the tables of db over to it for later statements.
+ */
+void xapian_vtab_register (sqlite3 *db, const Xapian::Database &xdb);
+
+#endif /* !_XAPIAN_VTAB_H_ */